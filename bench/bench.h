@@ -0,0 +1,129 @@
+/* bench.h
+
+Shared helpers for the display.h benchmarks: timing, stdout redirection and
+machine-readable (JSON lines) result output
+
+*/
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/// @brief Expands a parenthesized argument list, e.g. BENCH_ARGS ("%d", 1) -> "%d", 1
+#define BENCH_ARGS(...) __VA_ARGS__
+
+/// @brief Monotonic clock in nanoseconds
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static volatile int bench_sink_value;
+
+/// @brief Keeps the compiler from discarding a computed value
+static inline void bench_sink_int(int v) { bench_sink_value = v; }
+
+/// @brief Redirects stdout (fd 1) to /dev/null so the printing entry points can be measured
+/// without a terminal in the loop
+/// @return A stream on the original stdout for reporting, or NULL on failure
+static inline FILE *bench_silence_stdout(void) {
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  if (saved < 0 || null < 0)
+    return NULL;
+
+  dup2(null, STDOUT_FILENO);
+  close(null);
+  return fdopen(saved, "w");
+}
+
+/// @brief Opens the result stream: `path` if given, the original stdout otherwise
+static inline FILE *bench_open_results(const char *path, FILE *orig_stdout) {
+  if (path && strcmp(path, "-") != 0)
+    return fopen(path, "w");
+
+  return orig_stdout;
+}
+
+/// @brief Returns 1 if `name` is selected by a comma-separated filter (NULL selects all)
+static inline int bench_selected(const char *filter, const char *name) {
+  if (!filter)
+    return 1;
+
+  size_t n = strlen(name);
+  const char *p = filter;
+  while (*p) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len == n && strncmp(p, name, n) == 0)
+      return 1;
+    if (!end)
+      break;
+    p = end + 1;
+  }
+
+  return 0;
+}
+
+static inline int bench_cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/// @brief Sorts `n` samples in place, as required by bench_quantile
+static inline void bench_sort_u64(uint64_t *samples, size_t n) {
+  qsort(samples, n, sizeof(*samples), bench_cmp_u64);
+}
+
+/// @brief Returns the q-quantile (0..1) of `n` sorted samples
+static inline uint64_t bench_quantile(const uint64_t *samples, size_t n, double q) {
+  if (n == 0)
+    return 0;
+
+  size_t idx = (size_t)(q * (double)(n - 1) + 0.5);
+  return samples[idx < n ? idx : n - 1];
+}
+
+/// @brief Copies the string value of `"key":"..."` from a flat JSON object line
+/// @return 0 on success, -1 if the key is missing
+static inline int bench_json_str(const char *line, const char *key, char *out, size_t size) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+  const char *p = strstr(line, pattern);
+  if (!p || size == 0)
+    return -1;
+
+  p += strlen(pattern);
+  size_t n = 0;
+  while (p[n] && p[n] != '"' && n + 1 < size) {
+    out[n] = p[n];
+    n++;
+  }
+  out[n] = '\0';
+  return 0;
+}
+
+/// @brief Parses the numeric value of `"key":number` from a flat JSON object line
+/// @return 0 on success, -1 if the key is missing or null
+static inline int bench_json_num(const char *line, const char *key, double *out) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *p = strstr(line, pattern);
+  if (!p)
+    return -1;
+
+  p += strlen(pattern);
+  char *end;
+  *out = strtod(p, &end);
+  return end == p ? -1 : 0;
+}
+
+#endif // BENCH_H
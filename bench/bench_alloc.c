@@ -0,0 +1,211 @@
+/* bench_alloc.c
+
+Allocation-counting harness. malloc, calloc, realloc and free are interposed (forwarding to
+glibc's __libc_* implementations) and every entry point is called on a set of format shapes
+while the calling thread counts allocations.
+
+Shapes marked as allocation-free must not allocate at all; the harness exits with status 1
+when one of them does, so a regression in the formatting paths is caught immediately.
+
+Results are written as one JSON object per line:
+  {"bench":"alloc","entry":"snprint","shape":"integer","allocs_per_call":0.000,"ok":true}
+
+Usage: bench_alloc [-n calls] [-o file]
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include "bench.h"
+
+#include <getopt.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread int counting;
+static __thread uint64_t allocations;
+
+void *malloc(size_t size) {
+  if (counting)
+    allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  if (counting)
+    allocations++;
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  if (counting)
+    allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+typedef struct point_t {
+  display_t d;
+  int x, y;
+
+} point_t;
+
+static int display_point(const void *self) {
+  const point_t *p = (const point_t *)self;
+  return printf("(%d,%d)", p->x, p->y);
+}
+
+static int fdisplay_point(const void *self, FILE *file) {
+  const point_t *p = (const point_t *)self;
+  return fprintf(file, "(%d,%d)", p->x, p->y);
+}
+
+static int sndisplay_point(const void *self, char *buf, size_t size) {
+  const point_t *p = (const point_t *)self;
+  return snprintf(buf, size, "(%d,%d)", p->x, p->y);
+}
+
+static int discard_write(void *self, int level, const char *data, size_t len) {
+  (void)self;
+  (void)level;
+  (void)data;
+  (void)len;
+  return 0;
+}
+
+static point_t pt;
+static FILE *devnull;
+static char buf[1024];
+static display_sink_t discard = {discard_write, NULL, NULL, NULL};
+static display_sink_t *tee;    // Fans out to discard three times
+static display_sink_t *framed; // Frames records into discard
+// Longer than DISPLAY_STAGE_INLINE: framed without the stack buffer
+static char long_record[4 * DISPLAY_STAGE_INLINE];
+
+/// @brief X-macro of format shapes: name, allocation-free, call arguments
+#define SHAPES(X)                                                                                  \
+  X(literal, 1, ("no conversions at all, just text"))                                              \
+  X(percent, 1, ("100%% done, %%d is not a conversion"))                                          \
+  X(integer, 1, ("%d %u %ld %lld %hhd %hu %zu %jd %td %x %o", -1, 2u, 3L, 4LL, 5, 6, (size_t)7,   \
+                 (intmax_t)8, (ptrdiff_t)9, 10u, 11u))                                             \
+  X(floating, 1, ("%f %.3e %g %a %Lf", 1.5, -2.25, 3e10, 0.5, (long double)4.75))                  \
+  X(string, 1, ("%s|%-12s|%.3s|%c|%p", "abc", "padded", "truncated", 'z', (void *)buf))            \
+  X(boolean, 1, ("%b %b", 1, 0))                                                                   \
+  X(structs, 1, ("a={} b={}", &pt, &pt))                                                           \
+  X(mixed, 1, ("%s #%d [%5u] %x {} %.2f %-8s| %ld", "req", 1, 2u, 3u, &pt, 4.5, "x", 6L))          \
+  X(invalid, 1, ("%q %y trailing %", 1))
+
+#define DEFINE_SHAPE(name, zero, call)                                                             \
+  static int name##_print(void) { return display_print(BENCH_ARGS call); }                        \
+  static int name##_println(void) { return display_println(BENCH_ARGS call); }                    \
+  static int name##_fprint(void) { return display_fprint(devnull, BENCH_ARGS call); }             \
+  static int name##_fprintln(void) { return display_fprintln(devnull, BENCH_ARGS call); }         \
+  static int name##_snprint(void) { return display_snprint(buf, sizeof(buf), BENCH_ARGS call); }  \
+  static int name##_snprintln(void) {                                                              \
+    return display_snprintln(buf, sizeof(buf), BENCH_ARGS call);                                   \
+  }                                                                                                \
+  static int name##_sinkprint(void) { return display_sinkprint(&discard, BENCH_ARGS call); }      \
+  static int name##_sinkprintln(void) { return display_sinkprintln(&discard, BENCH_ARGS call); }  \
+  static int name##_teeprintln(void) { return display_sinkprintln(tee, BENCH_ARGS call); }        \
+  static int name##_framedprintln(void) { return display_sinkprintln(framed, BENCH_ARGS call); }
+
+SHAPES(DEFINE_SHAPE)
+
+typedef struct alloc_case_t {
+  const char *entry;
+  const char *shape;
+  int zero; // Must not allocate
+  int (*fn)(void);
+
+} alloc_case_t;
+
+#define CASES(name, zero, call)                                                                    \
+  {"print", #name, zero, name##_print}, {"println", #name, zero, name##_println},                  \
+      {"fprint", #name, zero, name##_fprint}, {"fprintln", #name, zero, name##_fprintln},          \
+      {"snprint", #name, zero, name##_snprint}, {"snprintln", #name, zero, name##_snprintln},      \
+      {"sinkprint", #name, zero, name##_sinkprint},                                                \
+      {"sinkprintln", #name, zero, name##_sinkprintln},                                            \
+      {"teeprintln", #name, zero, name##_teeprintln},                                              \
+      {"framedprintln", #name, zero, name##_framedprintln},
+
+/// @brief Writes long_record straight to the framed sink
+static int framed_long_write(void) {
+  return framed->write_fn(framed->self, DISPLAY_LEVEL_NONE, long_record, sizeof(long_record));
+}
+
+static const alloc_case_t cases[] = {SHAPES(CASES){"framedwrite", "long", 1, framed_long_write}};
+
+int main(int argc, char **argv) {
+  uint64_t calls = 1000;
+  const char *out_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:o:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      calls = strtoull(optarg, NULL, 10);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n calls] [-o file]\n", argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (calls < 1)
+    calls = 1;
+
+  pt = (point_t){{display_point, fdisplay_point, sndisplay_point, &pt}, 2, 3};
+  pt.d.self = &pt;
+
+  devnull = fopen("/dev/null", "w");
+  display_tee_child_t children[] = {{&discard, DISPLAY_LEVEL_NONE},
+                                    {&discard, DISPLAY_LEVEL_NONE},
+                                    {&discard, DISPLAY_LEVEL_NONE}};
+  tee = display_tee_open(children, 3);
+  framed = display_framed_open(&discard);
+  memset(long_record, 'x', sizeof(long_record));
+  FILE *orig_stdout = bench_silence_stdout();
+  FILE *out = bench_open_results(out_path, orig_stdout);
+  if (!devnull || !tee || !framed || !orig_stdout || !out) {
+    perror("bench_alloc");
+    return 1;
+  }
+
+  int failures = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const alloc_case_t *c = &cases[i];
+
+    c->fn(); // stdio allocates its stream buffers on first use
+
+    allocations = 0;
+    counting = 1;
+    for (uint64_t n = 0; n < calls; n++)
+      bench_sink_int(c->fn());
+    counting = 0;
+
+    int ok = !c->zero || allocations == 0;
+    failures += !ok;
+    fprintf(out,
+            "{\"bench\":\"alloc\",\"entry\":\"%s\",\"shape\":\"%s\",\"allocs_per_call\":%.3f,"
+            "\"expect_zero\":%s,\"ok\":%s}\n",
+            c->entry, c->shape, (double)allocations / (double)calls, c->zero ? "true" : "false",
+            ok ? "true" : "false");
+  }
+
+  if (failures)
+    fprintf(stderr, "bench_alloc: %d allocation-free path(s) allocated\n", failures);
+
+  display_sink_close(tee);
+  display_sink_close(framed);
+  fclose(devnull);
+  if (out != orig_stdout)
+    fclose(out);
+  fclose(orig_stdout);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,449 @@
+/* bench_diff.c
+
+Differential correctness-and-speed harness against glibc. Random conversion specifications
+(flags, width, precision and every length modifier of each var_type) are generated together
+with random values, and the output of display_snprint, display_fprint and display_sinkprint is
+compared byte for byte with snprintf. Truncated buffers are exercised as well. The same
+generated cases are then timed through display_snprint and snprintf, giving the speedup for
+each class of conversion.
+
+%n, '*' widths and %b have no libc equivalent to compare against and are not generated.
+
+Results are written as one JSON object per line:
+  {"bench":"diff","class":"signed","cases":...,"mismatches":0,"speedup":...}
+
+Usage: bench_diff [-n cases] [-s seed] [-t ms] [-o file]
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include "bench.h"
+
+#include <getopt.h>
+#include <math.h>
+
+enum {
+  CLASS_SIGNED,
+  CLASS_UNSIGNED,
+  CLASS_FLOAT,
+  CLASS_CHAR,
+  CLASS_STRING,
+  CLASS_POINTER,
+  NCLASSES,
+};
+
+static const char *const class_names[NCLASSES] = {
+    "signed", "unsigned", "float", "char", "string", "pointer",
+};
+
+static const char *const int_lengths[] = {"", "hh", "h", "l", "ll", "j", "z", "t"};
+static const char *const float_lengths[] = {"", "l", "L"};
+
+static const char *const strings[] = {
+    "", "a", "hello", "display.h", "with spaces and\ttabs", "0123456789abcdefghijklmnopqrstuvwxyz",
+};
+
+static const char *const literals[] = {
+    "", "x=", "[", "] ", "100%% ", "{not a struct} ", "value: ", "\t",
+};
+
+typedef struct diff_case_t {
+  char fmt[160];
+  int cls;
+  int length; // Index into int_lengths or float_lengths
+  union {
+    long long i;
+    unsigned long long u;
+    double d;
+    long double ld;
+    const char *s;
+    void *p;
+  } v;
+
+} diff_case_t;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+static uint64_t rng(void) {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned rng_below(unsigned n) { return (unsigned)(rng() % n); }
+
+static double random_double(void) {
+  switch (rng_below(6)) {
+  case 0: { // Any bit pattern: subnormals, huge values, inf and nan included
+    uint64_t bits = rng();
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+  }
+  case 1:
+    return (double)(int64_t)rng() / 1e6;
+  case 2:
+    return ldexp((double)(rng() >> 11), (int)rng_below(200) - 100);
+  case 3:
+    return (double)rng_below(1000) / 8.0;
+  case 4:
+    return -0.0;
+  default:
+    return (double)(int32_t)rng();
+  }
+}
+
+static void generate(diff_case_t *c) {
+  char spec[128];
+  size_t n = 0;
+  c->cls = (int)rng_below(NCLASSES);
+  c->length = 0;
+
+  spec[n++] = '%';
+
+  // Flags: only the ones the standard defines for the conversion
+  const char *flags = c->cls == CLASS_SIGNED || c->cls == CLASS_FLOAT ? "-+ #0"
+                      : c->cls == CLASS_UNSIGNED                     ? "-#0"
+                                                                     : "-";
+  for (const char *f = flags; *f; f++)
+    if (rng_below(4) == 0)
+      spec[n++] = *f;
+  // Now and then a specification longer than DISPLAY_SPEC_MAX: repeated '0' flags, then leading
+  // zeros in the precision
+  int long_spec = rng_below(16) == 0;
+  if (long_spec && strchr(flags, '0')) {
+    memset(spec + n, '0', 32);
+    n += 32;
+  }
+
+  if (rng_below(2))
+    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%u", rng_below(24));
+  if (c->cls != CLASS_CHAR && c->cls != CLASS_POINTER && rng_below(2)) {
+    spec[n++] = '.';
+    if (long_spec) {
+      memset(spec + n, '0', 32);
+      n += 32;
+    }
+    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%u",
+                          rng_below(c->cls == CLASS_FLOAT ? 20 : 12));
+  }
+
+  switch (c->cls) {
+  case CLASS_SIGNED:
+  case CLASS_UNSIGNED: {
+    c->length = (int)rng_below(sizeof(int_lengths) / sizeof(int_lengths[0]));
+    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%s", int_lengths[c->length]);
+    spec[n++] = c->cls == CLASS_SIGNED ? "di"[rng_below(2)] : "ouxX"[rng_below(4)];
+
+    uint64_t bits = rng();
+    c->v.u = rng_below(3) == 0 ? bits >> rng_below(64) : bits; // Favour short numbers too
+    break;
+  }
+  case CLASS_FLOAT:
+    c->length = (int)rng_below(sizeof(float_lengths) / sizeof(float_lengths[0]));
+    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%s", float_lengths[c->length]);
+    spec[n++] = "eEfFgGaA"[rng_below(8)];
+    if (c->length == 2)
+      c->v.ld = (long double)random_double() * (rng_below(2) ? 1.0L : 3.0L);
+    else
+      c->v.d = random_double();
+    break;
+  case CLASS_CHAR:
+    spec[n++] = 'c';
+    c->v.i = ' ' + (int)rng_below(95);
+    break;
+  case CLASS_STRING:
+    spec[n++] = 's';
+    c->v.s = strings[rng_below(sizeof(strings) / sizeof(strings[0]))];
+    break;
+  case CLASS_POINTER:
+    spec[n++] = 'p';
+    c->v.p = rng_below(4) == 0 ? NULL : (void *)(uintptr_t)rng();
+    break;
+  }
+  spec[n] = '\0';
+
+  const char *prefix = literals[rng_below(8)], *suffix = literals[rng_below(8)];
+  snprintf(c->fmt, sizeof(c->fmt), "%s%s%s", prefix, spec, suffix);
+}
+
+enum { IMPL_LIBC, IMPL_SNPRINT, IMPL_FPRINT, IMPL_SINK };
+
+typedef struct target_t {
+  int impl;
+  char *buf;
+  size_t size;
+  FILE *file;           // IMPL_FPRINT only
+  display_sink_t *sink; // IMPL_SINK only
+
+} target_t;
+
+// Calls snprintf, display_snprint, display_fprint or display_sinkprint with the argument type
+// of the case
+#define CALL(t, fmt, arg)                                                                          \
+  ((t)->impl == IMPL_LIBC      ? snprintf((t)->buf, (t)->size, fmt, arg)                          \
+   : (t)->impl == IMPL_SNPRINT ? display_snprint((t)->buf, (t)->size, fmt, arg)                   \
+   : (t)->impl == IMPL_FPRINT  ? display_fprint((t)->file, fmt, arg)                              \
+                               : display_sinkprint((t)->sink, fmt, arg))
+
+static int call(const target_t *t, const diff_case_t *c) {
+  switch (c->cls) {
+  case CLASS_SIGNED:
+    switch (c->length) {
+    case 0:
+      return CALL(t, c->fmt, (int)c->v.i);
+    case 1:
+      return CALL(t, c->fmt, (signed char)c->v.i);
+    case 2:
+      return CALL(t, c->fmt, (short)c->v.i);
+    case 3:
+      return CALL(t, c->fmt, (long)c->v.i);
+    case 4:
+      return CALL(t, c->fmt, (long long)c->v.i);
+    case 5:
+      return CALL(t, c->fmt, (intmax_t)c->v.i);
+    case 6:
+      return CALL(t, c->fmt, (ssize_t)c->v.i);
+    default:
+      return CALL(t, c->fmt, (ptrdiff_t)c->v.i);
+    }
+  case CLASS_UNSIGNED:
+    switch (c->length) {
+    case 0:
+      return CALL(t, c->fmt, (unsigned)c->v.u);
+    case 1:
+      return CALL(t, c->fmt, (unsigned char)c->v.u);
+    case 2:
+      return CALL(t, c->fmt, (unsigned short)c->v.u);
+    case 3:
+      return CALL(t, c->fmt, (unsigned long)c->v.u);
+    case 4:
+      return CALL(t, c->fmt, (unsigned long long)c->v.u);
+    case 5:
+      return CALL(t, c->fmt, (uintmax_t)c->v.u);
+    case 6:
+      return CALL(t, c->fmt, (size_t)c->v.u);
+    default:
+      return CALL(t, c->fmt, (ptrdiff_t)c->v.u);
+    }
+  case CLASS_FLOAT:
+    if (c->length == 2)
+      return CALL(t, c->fmt, c->v.ld);
+    return CALL(t, c->fmt, c->v.d);
+  case CLASS_CHAR:
+    return CALL(t, c->fmt, (int)c->v.i);
+  case CLASS_STRING:
+    return CALL(t, c->fmt, c->v.s);
+  default:
+    return CALL(t, c->fmt, c->v.p);
+  }
+}
+
+static int call_snprint(int impl, char *buf, size_t size, const diff_case_t *c) {
+  target_t t = {impl, buf, size, NULL, NULL};
+  return call(&t, c);
+}
+
+// A sink capturing the record it receives into a buffer
+typedef struct capture_t {
+  display_sink_t sink;
+  char *buf;
+  size_t size;
+
+} capture_t;
+
+static int capture_write(void *self, int level, const char *data, size_t len) {
+  capture_t *cap = (capture_t *)self;
+  (void)level;
+  if (len >= cap->size)
+    return -1;
+
+  memcpy(cap->buf, data, len);
+  cap->buf[len] = '\0';
+  return 0;
+}
+
+/// @brief Formats the case through display_sinkprint into `buf`
+static int call_sinkprint(char *buf, size_t size, const diff_case_t *c) {
+  capture_t cap = {{capture_write, NULL, NULL, NULL}, buf, size};
+  cap.sink.self = &cap;
+  buf[0] = '\0';
+
+  target_t t = {IMPL_SINK, NULL, 0, NULL, &cap.sink};
+  return call(&t, c);
+}
+
+/// @brief Formats the case through display_fprint into a memory stream
+/// @return Malloc'd output, NUL-terminated
+static char *call_fprint(const diff_case_t *c, size_t *len) {
+  char *out = NULL;
+  FILE *f = open_memstream(&out, len);
+  if (!f)
+    return NULL;
+
+  target_t t = {IMPL_FPRINT, NULL, 0, f, NULL};
+  call(&t, c);
+  fclose(f);
+  return out;
+}
+
+static int report_mismatch(const diff_case_t *c, const char *what, const char *expected,
+                           int expected_ret, const char *actual, int actual_ret) {
+  static int reported;
+  if (reported++ < 20)
+    fprintf(stderr, "mismatch (%s) fmt=\"%s\": libc [%s] %d, display [%s] %d\n", what, c->fmt,
+            expected, expected_ret, actual, actual_ret);
+  return 1;
+}
+
+/// @brief Checks one case: full buffer, a truncating buffer, the FILE path and the sink path
+/// @return Number of mismatches
+static int check(const diff_case_t *c) {
+  char expected[512], actual[512];
+  int mismatches = 0;
+
+  int e = call_snprint(IMPL_LIBC, expected, sizeof(expected), c);
+  int a = call_snprint(IMPL_SNPRINT, actual, sizeof(actual), c);
+  if (e != a || strcmp(expected, actual) != 0)
+    mismatches += report_mismatch(c, "snprint", expected, e, actual, a);
+
+  if (e > 0) {
+    size_t size = rng_below((unsigned)e + 1);
+    memset(expected, 'E', sizeof(expected) - 1);
+    memset(actual, 'E', sizeof(actual) - 1);
+    int te = call_snprint(IMPL_LIBC, expected, size, c);
+    int ta = call_snprint(IMPL_SNPRINT, actual, size, c);
+    if (te != ta || memcmp(expected, actual, size + 1) != 0)
+      mismatches += report_mismatch(c, "truncated", expected, te, actual, ta);
+  }
+
+  call_snprint(IMPL_LIBC, expected, sizeof(expected), c);
+  size_t len = 0;
+  char *out = call_fprint(c, &len);
+  if (out && (len != strlen(expected) || memcmp(out, expected, len) != 0))
+    mismatches += report_mismatch(c, "fprint", expected, e, out, (int)len);
+  free(out);
+
+  a = call_sinkprint(actual, sizeof(actual), c);
+  if (e != a || strcmp(expected, actual) != 0)
+    mismatches += report_mismatch(c, "sinkprint", expected, e, actual, a);
+
+  return mismatches;
+}
+
+/// @brief Checks that a specification longer than DISPLAY_SPEC_MAX consumes its argument, so that
+/// the next one is still read with the right type
+/// @return Number of mismatches
+static int check_long_spec(void) {
+  // Built at run time like the generated cases: the compiler rejects repeated flags in a literal
+  char zeros[33], fmt[128], expected[128], actual[128];
+  memset(zeros, '0', 32);
+  zeros[32] = '\0';
+  snprintf(fmt, sizeof(fmt), "[%%%s5d] [%%s] [%%.%s3s]", zeros, zeros);
+
+  int e = snprintf(expected, sizeof(expected), fmt, 7, "next", "abcdef");
+  int a = display_snprint(actual, sizeof(actual), fmt, 7, "next", "abcdef");
+  if (e == a && strcmp(expected, actual) == 0)
+    return 0;
+
+  fprintf(stderr, "mismatch (long spec) fmt=\"%s\": libc [%s] %d, display [%s] %d\n", fmt,
+          expected, e, actual, a);
+  return 1;
+}
+
+/// @brief Times `count` cases of one class through display_snprint or snprintf
+/// @return Nanoseconds per call
+static double time_class(int impl, const diff_case_t *cases, size_t count, uint64_t target_ns) {
+  char buf[512];
+  uint64_t calls = 0, start = bench_now_ns(), elapsed;
+
+  do {
+    for (size_t i = 0; i < count; i++)
+      bench_sink_int(call_snprint(impl, buf, sizeof(buf), &cases[i]));
+    calls += count;
+    elapsed = bench_now_ns() - start;
+  } while (elapsed < target_ns);
+
+  return (double)elapsed / (double)calls;
+}
+
+int main(int argc, char **argv) {
+  size_t count = 200000;
+  uint64_t target_ms = 200;
+  const char *out_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:t:o:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      count = strtoull(optarg, NULL, 10);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    case 't':
+      target_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n cases] [-s seed] [-t ms] [-o file]\n", argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  FILE *out = bench_open_results(out_path, stdout);
+  diff_case_t *cases = (diff_case_t *)malloc(count * sizeof(diff_case_t));
+  if (!out || !cases) {
+    perror("bench_diff");
+    return 1;
+  }
+
+  size_t per_class[NCLASSES] = {0};
+  int mismatches[NCLASSES] = {0}, total_mismatches = check_long_spec();
+  for (size_t i = 0; i < count; i++) {
+    generate(&cases[i]);
+    per_class[cases[i].cls]++;
+    int m = check(&cases[i]);
+    mismatches[cases[i].cls] += m;
+    total_mismatches += m;
+  }
+
+  // Group the cases by class for timing
+  diff_case_t *grouped = (diff_case_t *)malloc(count * sizeof(diff_case_t));
+  if (!grouped) {
+    perror("bench_diff");
+    return 1;
+  }
+
+  size_t offset = 0;
+  for (int cls = 0; cls < NCLASSES; cls++) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++)
+      if (cases[i].cls == cls)
+        grouped[offset + n++] = cases[i];
+
+    uint64_t target_ns = target_ms * 1000000ull;
+    double display_ns = n ? time_class(IMPL_SNPRINT, grouped + offset, n, target_ns) : 0;
+    double libc_ns = n ? time_class(IMPL_LIBC, grouped + offset, n, target_ns) : 0;
+    fprintf(out,
+            "{\"bench\":\"diff\",\"class\":\"%s\",\"cases\":%zu,\"mismatches\":%d,"
+            "\"display_ns_per_call\":%.2f,\"libc_ns_per_call\":%.2f,\"speedup\":%.3f}\n",
+            class_names[cls], per_class[cls], mismatches[cls], display_ns, libc_ns,
+            display_ns > 0 ? libc_ns / display_ns : 0.0);
+    offset += n;
+  }
+
+  if (total_mismatches)
+    fprintf(stderr, "bench_diff: %d mismatch(es)\n", total_mismatches);
+
+  free(cases);
+  free(grouped);
+  if (out != stdout)
+    fclose(out);
+  return total_mismatches ? 1 : 0;
+}
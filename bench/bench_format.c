@@ -0,0 +1,356 @@
+/* bench_format.c
+
+Microbenchmark of the display.h entry points against the equivalent libc calls.
+Every workload runs through display_print, display_fprint and display_snprint, and
+through printf, fprintf and snprintf with a format producing the same text.
+
+Results are written as one JSON object per line:
+  {"bench":"format","workload":"integer","entry":"snprint","impl":"display",...}
+
+With -c, every case also gets a counting pass through perf_event_open reporting cycles,
+instructions, branch misses and L1D/LLC misses per call, plus IPC and instructions per output
+byte. Instruction counts are stable across runs, so -g compares them against a previous result
+file and fails when any case regressed by more than -G percent.
+
+Usage: bench_format [-t ms] [-r reps] [-w workloads] [-e entries] [-o file]
+                    [-c] [-n calls] [-g baseline.jsonl] [-G pct]
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include "bench.h"
+#include "perf_counters.h"
+
+#include <getopt.h>
+
+typedef struct point_t {
+  display_t d;
+  int x, y;
+
+} point_t;
+
+static int display_point(const void *self) {
+  const point_t *p = (const point_t *)self;
+  return printf("(%d,%d)", p->x, p->y);
+}
+
+static int fdisplay_point(const void *self, FILE *file) {
+  const point_t *p = (const point_t *)self;
+  return fprintf(file, "(%d,%d)", p->x, p->y);
+}
+
+static int sndisplay_point(const void *self, char *buf, size_t size) {
+  const point_t *p = (const point_t *)self;
+  return snprintf(buf, size, "(%d,%d)", p->x, p->y);
+}
+
+static point_t pa, pb, pc;
+static FILE *devnull;
+static char buf[1024];
+
+// Arguments live in globals so the compiler cannot fold them into the format
+static int i0 = 12345, i1 = -678;
+static unsigned u0 = 4000000000u;
+static long l0 = -1234567890L;
+static unsigned long long ull0 = 18446744073709551615ull;
+static double d0 = 3.14159265358979, d1 = -0.000123456, d2 = 6.02214076e23;
+static const char *s0 = "request";
+static void *p0 = &i0;
+// j0 as a JSON string, for the libc side of the escape workload
+static const char *j0 = "Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 \"compatible\" agent";
+// A SHA-256, and its hex digits and base64 for the libc side of the hex and base64 workloads
+static const unsigned char h0[32] = {
+    0x4a, 0x8c, 0x97, 0x68, 0xf6, 0x71, 0x30, 0x91, 0x7c, 0xfc, 0x8d, 0x17, 0x8b, 0x5c, 0x34, 0x0d,
+    0x73, 0x78, 0x89, 0x15, 0xc5, 0xfe, 0xbf, 0x95, 0xdf, 0x2c, 0x99, 0x28, 0x86, 0x79, 0x10, 0x30};
+static const char *h0x = "4a8c9768f67130917cfc8d178b5c340d73788915c5febf95df2c992886791030";
+static const char *h0b = "SoyXaPZxMJF8/I0Xi1w0DXN4iRXF/r+V3yyZKIZ5EDA=";
+// u0 in binary, for the libc side of the binary workload
+static const char *u0b = "1110_1110_0110_1011_0010_1000_0000_0000";
+static const char *j0e = "Mozilla/5.0 (X11; Linux x86_64) Gecko/20100101 \\\"compatible\\\" agent";
+
+/// @brief X-macro of workloads: name, display.h call arguments, libc call arguments
+#define WORKLOADS(X)                                                                               \
+  X(literal,                                                                                       \
+    ("GET /index.html HTTP/1.1 served from cache, no upstream request was made for this hit"),     \
+    ("GET /index.html HTTP/1.1 served from cache, no upstream request was made for this hit"))     \
+  X(integer, ("id=%d delta=%d n=%u off=%ld max=%llu", i0, i1, u0, l0, ull0),                       \
+    ("id=%d delta=%d n=%u off=%ld max=%llu", i0, i1, u0, l0, ull0))                                \
+  X(floating, ("x=%f y=%.3f z=%e w=%g", d0, d1, d2, d0),                                           \
+    ("x=%f y=%.3f z=%e w=%g", d0, d1, d2, d0))                                                     \
+  X(display, ("a={} b={} c={}", &pa, &pb, &pc),                                                    \
+    ("a=(%d,%d) b=(%d,%d) c=(%d,%d)", pa.x, pa.y, pb.x, pb.y, pc.x, pc.y))                         \
+  X(mixed, ("%s #%d [%5u] %x %c %p %.2f %-8s| %ld %hhd %zu {}", s0, i0, u0, u0, 'k', p0, d0, s0,   \
+            l0, i1, sizeof(buf), &pa),                                                             \
+    ("%s #%d [%5u] %x %c %p %.2f %-8s| %ld %hhd %zu (%d,%d)", s0, i0, u0, u0, 'k', p0, d0, s0, l0, \
+     i1, sizeof(buf), pa.x, pa.y))                                                                 \
+  X(escape, ("{\"agent\":\"{:s|json}\"}", j0), ("{\"agent\":\"%s\"}", j0e))                        \
+  X(hex, ("sha256={:x}", h0, sizeof(h0)), ("sha256=%s", h0x))                                      \
+  X(base64, ("sig={:b64}", h0, sizeof(h0)), ("sig=%s", h0b))                                       \
+  X(binary, ("flags={:0_b}", u0), ("flags=%s", u0b))
+
+#define DEFINE_WORKLOAD(name, dcall, ccall)                                                        \
+  static int name##_display_print(void) { return display_print(BENCH_ARGS dcall); }               \
+  static int name##_display_fprint(void) { return display_fprint(devnull, BENCH_ARGS dcall); }    \
+  static int name##_display_snprint(void) {                                                        \
+    return display_snprint(buf, sizeof(buf), BENCH_ARGS dcall);                                    \
+  }                                                                                                \
+  static int name##_libc_print(void) { return printf(BENCH_ARGS ccall); }                          \
+  static int name##_libc_fprint(void) { return fprintf(devnull, BENCH_ARGS ccall); }               \
+  static int name##_libc_snprint(void) { return snprintf(buf, sizeof(buf), BENCH_ARGS ccall); }
+
+WORKLOADS(DEFINE_WORKLOAD)
+
+typedef struct bench_case_t {
+  const char *workload;
+  const char *entry;
+  const char *impl;
+  int (*fn)(void);
+  int (*len_fn)(void); // Output length of one call, in bytes
+
+} bench_case_t;
+
+#define CASES(name, dcall, ccall)                                                                  \
+  {#name, "print", "display", name##_display_print, name##_display_snprint},                      \
+      {#name, "print", "libc", name##_libc_print, name##_libc_snprint},                            \
+      {#name, "fprint", "display", name##_display_fprint, name##_display_snprint},                 \
+      {#name, "fprint", "libc", name##_libc_fprint, name##_libc_snprint},                          \
+      {#name, "snprint", "display", name##_display_snprint, name##_display_snprint},               \
+      {#name, "snprint", "libc", name##_libc_snprint, name##_libc_snprint},
+
+static const bench_case_t cases[] = {WORKLOADS(CASES)};
+
+#define WORKLOAD_NAME(name, dcall, ccall) "," #name
+
+// ",literal,integer,...": the usage text lists the workloads from WORKLOADS, skipping the comma
+static const char workload_names[] = WORKLOADS(WORKLOAD_NAME);
+
+/// @brief Runs `fn` in batches until `target_ns` elapsed
+/// @return Nanoseconds per call
+static double run_case(int (*fn)(void), uint64_t target_ns, uint64_t *calls_out) {
+  enum { BATCH = 256 };
+  uint64_t calls = 0, start = bench_now_ns(), elapsed = 0;
+
+  do {
+    for (int i = 0; i < BATCH; i++)
+      bench_sink_int(fn());
+    calls += BATCH;
+    elapsed = bench_now_ns() - start;
+  } while (elapsed < target_ns);
+
+  *calls_out = calls;
+  return (double)elapsed / (double)calls;
+}
+
+/// @brief Runs `calls` calls of `fn` under the counters
+/// @return 0 on success, -1 if the counters could not be read
+static int count_case(bench_counters_t *counters, int (*fn)(void), uint64_t calls,
+                      double out[BENCH_NCOUNTERS]) {
+  for (int i = 0; i < 64; i++) // Warm caches and branch predictors
+    bench_sink_int(fn());
+
+  bench_counters_start(counters);
+  for (uint64_t i = 0; i < calls; i++)
+    bench_sink_int(fn());
+  if (bench_counters_stop(counters, out) != 0)
+    return -1;
+
+  for (int i = 0; i < BENCH_NCOUNTERS; i++)
+    if (out[i] >= 0)
+      out[i] /= (double)calls;
+
+  return 0;
+}
+
+/// @brief Appends `"name":value` (or null when negative) to a JSON line
+static size_t append_metric(char *line, size_t size, size_t len, const char *name, double value) {
+  if (len >= size)
+    return len;
+
+  int n = value < 0 ? snprintf(line + len, size - len, ",\"%s\":null", name)
+                    : snprintf(line + len, size - len, ",\"%s\":%.3f", name, value);
+  return n > 0 ? len + (size_t)n : len;
+}
+
+/// @brief Compares instructions/call against the matching line of a baseline result file
+/// @return 1 if the case regressed by more than `max_pct`, 0 otherwise
+static int gate_case(FILE *baseline, const bench_case_t *c, double instructions, double max_pct) {
+  char line[1024], workload[32], entry[32], impl[32];
+  double base;
+
+  rewind(baseline);
+  while (fgets(line, sizeof(line), baseline)) {
+    if (bench_json_str(line, "workload", workload, sizeof(workload)) != 0 ||
+        bench_json_str(line, "entry", entry, sizeof(entry)) != 0 ||
+        bench_json_str(line, "impl", impl, sizeof(impl)) != 0)
+      continue;
+    if (strcmp(workload, c->workload) != 0 || strcmp(entry, c->entry) != 0 ||
+        strcmp(impl, c->impl) != 0)
+      continue;
+    if (bench_json_num(line, "instructions_per_call", &base) != 0 || base <= 0)
+      return 0;
+
+    double pct = (instructions - base) * 100.0 / base;
+    if (pct > max_pct) {
+      fprintf(stderr, "regression: %s/%s/%s instructions/call %.1f -> %.1f (+%.2f%%)\n",
+              c->workload, c->entry, c->impl, base, instructions, pct);
+      return 1;
+    }
+    return 0;
+  }
+
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-t ms] [-r reps] [-w workloads] [-e entries] [-o file]\n"
+          "  -t ms         time per repetition (default 200)\n"
+          "  -r reps       repetitions, the fastest is reported (default 3)\n"
+          "  -w workloads  comma-separated: %s\n"
+          "  -e entries    comma-separated: print,fprint,snprint\n"
+          "  -o file       write results to file instead of stdout\n"
+          "  -c            read hardware counters (perf_event_open) per case\n"
+          "  -n calls      calls in the counting pass (default 100000)\n"
+          "  -g file       gate on instructions/call against a previous -c result file\n"
+          "  -G pct        allowed instructions/call regression for -g (default 2)\n",
+          argv0, workload_names + 1);
+}
+
+int main(int argc, char **argv) {
+  uint64_t target_ms = 200;
+  int reps = 3;
+  const char *workloads = NULL, *entries = NULL, *out_path = NULL, *baseline_path = NULL;
+  int use_counters = 0;
+  uint64_t count_calls = 100000;
+  double max_pct = 2.0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:r:w:e:o:cn:g:G:h")) != -1) {
+    switch (opt) {
+    case 't':
+      target_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 'w':
+      workloads = optarg;
+      break;
+    case 'e':
+      entries = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    case 'c':
+      use_counters = 1;
+      break;
+    case 'n':
+      count_calls = strtoull(optarg, NULL, 10);
+      break;
+    case 'g':
+      baseline_path = optarg;
+      use_counters = 1;
+      break;
+    case 'G':
+      max_pct = strtod(optarg, NULL);
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (reps < 1)
+    reps = 1;
+  if (count_calls < 1)
+    count_calls = 1;
+
+  bench_counters_t counters;
+  if (use_counters && bench_counters_open(&counters) != 0) {
+    perror("bench_format: perf_event_open");
+    if (baseline_path)
+      return 1;
+    use_counters = 0;
+  }
+
+  FILE *baseline = NULL;
+  if (baseline_path && !(baseline = fopen(baseline_path, "r"))) {
+    perror(baseline_path);
+    return 1;
+  }
+
+  pa = (point_t){{display_point, fdisplay_point, sndisplay_point, &pa}, 2, 3};
+  pb = (point_t){{display_point, fdisplay_point, sndisplay_point, &pb}, -40, 50};
+  pc = (point_t){{display_point, fdisplay_point, sndisplay_point, &pc}, 600, -7000};
+  pa.d.self = &pa;
+  pb.d.self = &pb;
+  pc.d.self = &pc;
+
+  devnull = fopen("/dev/null", "w");
+  FILE *orig_stdout = bench_silence_stdout();
+  FILE *out = bench_open_results(out_path, orig_stdout);
+  if (!devnull || !orig_stdout || !out) {
+    perror("bench_format");
+    return 1;
+  }
+
+  int regressions = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    const bench_case_t *c = &cases[i];
+    if (!bench_selected(workloads, c->workload) || !bench_selected(entries, c->entry))
+      continue;
+
+    int bytes = c->len_fn();
+    double best = 0;
+    uint64_t calls = 0;
+    for (int r = 0; r < reps; r++) {
+      uint64_t n;
+      double ns = run_case(c->fn, target_ms * 1000000ull, &n);
+      if (r == 0 || ns < best) {
+        best = ns;
+        calls = n;
+      }
+    }
+
+    char line[1024];
+    int n = snprintf(line, sizeof(line),
+                     "{\"bench\":\"format\",\"workload\":\"%s\",\"entry\":\"%s\",\"impl\":\"%s\","
+                     "\"calls\":%llu,\"ns_per_call\":%.2f,\"bytes_per_call\":%d,"
+                     "\"bytes_per_sec\":%.0f",
+                     c->workload, c->entry, c->impl, (unsigned long long)calls, best, bytes,
+                     best > 0 ? bytes * 1e9 / best : 0.0);
+    size_t len = n > 0 ? (size_t)n : 0;
+
+    double per_call[BENCH_NCOUNTERS];
+    if (use_counters && count_case(&counters, c->fn, count_calls, per_call) == 0) {
+      for (int k = 0; k < BENCH_NCOUNTERS; k++) {
+        char name[48];
+        snprintf(name, sizeof(name), "%s_per_call", bench_counter_names[k]);
+        len = append_metric(line, sizeof(line), len, name, per_call[k]);
+      }
+
+      double cycles = per_call[BENCH_CYCLES], instructions = per_call[BENCH_INSTRUCTIONS];
+      len = append_metric(line, sizeof(line), len, "ipc",
+                          cycles > 0 && instructions >= 0 ? instructions / cycles : -1.0);
+      len = append_metric(line, sizeof(line), len, "instructions_per_byte",
+                          bytes > 0 && instructions >= 0 ? instructions / bytes : -1.0);
+
+      if (baseline && instructions >= 0)
+        regressions += gate_case(baseline, c, instructions, max_pct);
+    }
+
+    fprintf(out, "%s}\n", line);
+    fflush(out);
+  }
+
+  if (use_counters)
+    bench_counters_close(&counters);
+  if (baseline)
+    fclose(baseline);
+  fclose(devnull);
+  if (out != orig_stdout)
+    fclose(out);
+  fclose(orig_stdout);
+  return regressions ? 1 : 0;
+}
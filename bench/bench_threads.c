@@ -0,0 +1,406 @@
+/* bench_threads.c
+
+Contention benchmark: N threads each call display_fprintln in a loop, either all on one
+shared FILE or each on its own FILE, or display_sinkprintln on one shared sink over the same
+file: display_fdbuf_open (mode "fdbuf") or display_file_sink_open flushing every 64 KiB or 1 ms
+(mode "filesink"). Mode "durable" appends through display_durable_open and waits for every
+record to be synced, to measure group commit, and mode "mmap" appends to display_mmap_open
+segments, and mode "rotate" writes to display_rotate_open rolling over every 8 MiB (rotated
+files are deleted), mode "uring" flushes through display_uring_open and mode "direct" writes
+1 MiB O_DIRECT blocks from a second thread with display_direct_open, and mode "lz4" compresses
+through display_lz4_open. Mode "shard" gives every thread its own file with display_shard_open;
+their logs go to -d dir, or /tmp. Mode "reorder" numbers records from one counter and writes
+them in that order through display_reorder_open over the shared file. Reports aggregate
+throughput, per-call latency percentiles and the scaling efficiency relative to the
+single-thread run of the same mode.
+
+Results are written as one JSON object per line:
+  {"bench":"threads","mode":"shared","threads":8,"calls_per_sec":...,"p50_ns":...,...}
+
+Usage: bench_threads [-n calls] [-T max_threads] [-m modes] [-d dir] [-o file]
+
+*/
+#define _GNU_SOURCE // O_DIRECT
+#define DISPLAY_IMPLEMENTATION
+#ifdef __linux__
+#define DISPLAY_IO_URING
+#endif
+#include "../display.h"
+
+#include "bench.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct bench_mode_t bench_mode_t;
+
+typedef struct worker_t {
+  const bench_mode_t *mode;
+  int id;
+  uint64_t calls;
+  uint64_t *latencies; // ns per call
+  FILE *file;
+  display_sink_t *sink;
+
+} worker_t;
+
+struct bench_mode_t {
+  const char *name;
+  // Prepares per-thread state before the timed section, returns -1 on failure
+  int (*setup)(worker_t *w);
+  // One logging call
+  int (*call)(worker_t *w, uint64_t seq);
+  void (*teardown)(worker_t *w);
+};
+
+static const char *out_dir = NULL;
+static FILE *shared_file;
+static display_sink_t *shared_sink, *shared_file_sink, *durable_sink, *mmap_sink, *rotate_sink;
+static display_sink_t *uring_sink, *direct_sink, *lz4_sink, *shard_sink, *reorder_sink;
+static _Atomic uint64_t reorder_next; // Sequence numbers of reorder_sink
+static pthread_barrier_t start_barrier;
+
+static FILE *open_target(int id) {
+  if (!out_dir)
+    return fopen("/dev/null", "w");
+
+  char path[4096];
+  if (id < 0)
+    snprintf(path, sizeof(path), "%s/bench_threads.shared.log", out_dir);
+  else
+    snprintf(path, sizeof(path), "%s/bench_threads.%d.log", out_dir, id);
+  return fopen(path, "w");
+}
+
+static int log_line(FILE *file, int id, uint64_t seq) {
+  return display_fprintln(file, "worker=%d seq=%llu status=%s bytes=%u latency_us=%ld", id,
+                          (unsigned long long)seq, "ok", (unsigned)(seq * 31u), (long)(seq % 997));
+}
+
+static int shared_setup(worker_t *w) {
+  w->file = shared_file;
+  return 0;
+}
+
+static int shared_call(worker_t *w, uint64_t seq) { return log_line(w->file, w->id, seq); }
+
+static void shared_teardown(worker_t *w) { (void)w; }
+
+static int separate_setup(worker_t *w) {
+  w->file = open_target(w->id);
+  return w->file ? 0 : -1;
+}
+
+static void separate_teardown(worker_t *w) { fclose(w->file); }
+
+static int fdbuf_setup(worker_t *w) {
+  w->sink = shared_sink;
+  return 0;
+}
+
+static int fdbuf_call(worker_t *w, uint64_t seq) {
+  return display_sinkprintln(w->sink, "worker=%d seq=%llu status=%s bytes=%u latency_us=%ld",
+                             w->id, (unsigned long long)seq, "ok", (unsigned)(seq * 31u),
+                             (long)(seq % 997));
+}
+
+static void fdbuf_teardown(worker_t *w) { display_sink_flush(w->sink); }
+
+static int filesink_setup(worker_t *w) {
+  w->sink = shared_file_sink;
+  return 0;
+}
+
+static int durable_setup(worker_t *w) {
+  w->sink = durable_sink;
+  return durable_sink ? 0 : -1;
+}
+
+static int mmap_setup(worker_t *w) {
+  w->sink = mmap_sink;
+  return mmap_sink ? 0 : -1;
+}
+
+static int rotate_setup(worker_t *w) {
+  w->sink = rotate_sink;
+  return rotate_sink ? 0 : -1;
+}
+
+static int uring_setup(worker_t *w) {
+  w->sink = uring_sink;
+  return uring_sink ? 0 : -1;
+}
+
+static int direct_setup(worker_t *w) {
+  w->sink = direct_sink;
+  return direct_sink ? 0 : -1;
+}
+
+static int lz4_setup(worker_t *w) {
+  w->sink = lz4_sink;
+  return lz4_sink ? 0 : -1;
+}
+
+static int shard_setup(worker_t *w) {
+  w->sink = shard_sink;
+  return shard_sink ? 0 : -1;
+}
+
+static int reorder_setup(worker_t *w) {
+  w->sink = reorder_sink;
+  return reorder_sink ? 0 : -1;
+}
+
+static int reorder_call(worker_t *w, uint64_t seq) {
+  return display_reorder_println(w->sink, atomic_fetch_add(&reorder_next, 1),
+                                 "worker=%d seq=%llu status=%s bytes=%u latency_us=%ld", w->id,
+                                 (unsigned long long)seq, "ok", (unsigned)(seq * 31u),
+                                 (long)(seq % 997));
+}
+
+static void rotated_unlink(const char *rotated_path, void *arg) {
+  (void)arg;
+  unlink(rotated_path);
+}
+
+static int durable_call(worker_t *w, uint64_t seq) {
+  uint64_t ticket;
+  int n = display_durable_println(w->sink, &ticket, "worker=%d seq=%llu status=%s bytes=%u",
+                                  w->id, (unsigned long long)seq, "ok", (unsigned)(seq * 31u));
+  return display_durable_wait(w->sink, ticket) == 0 ? n : -1;
+}
+
+static const bench_mode_t modes[] = {
+    {"shared", shared_setup, shared_call, shared_teardown},
+    {"separate", separate_setup, shared_call, separate_teardown},
+    {"fdbuf", fdbuf_setup, fdbuf_call, fdbuf_teardown},
+    {"filesink", filesink_setup, fdbuf_call, fdbuf_teardown},
+    {"durable", durable_setup, durable_call, fdbuf_teardown},
+    {"mmap", mmap_setup, fdbuf_call, fdbuf_teardown},
+    {"rotate", rotate_setup, fdbuf_call, fdbuf_teardown},
+    {"uring", uring_setup, fdbuf_call, fdbuf_teardown},
+    {"direct", direct_setup, fdbuf_call, fdbuf_teardown},
+    {"lz4", lz4_setup, fdbuf_call, fdbuf_teardown},
+    {"shard", shard_setup, fdbuf_call, fdbuf_teardown},
+    {"reorder", reorder_setup, reorder_call, fdbuf_teardown},
+};
+
+static void *worker_main(void *arg) {
+  worker_t *w = (worker_t *)arg;
+  pthread_barrier_wait(&start_barrier);
+
+  for (uint64_t i = 0; i < w->calls; i++) {
+    uint64_t t0 = bench_now_ns();
+    w->mode->call(w, i);
+    w->latencies[i] = bench_now_ns() - t0;
+  }
+
+  return NULL;
+}
+
+/// @brief Runs one mode with `nthreads` threads
+/// @return Calls per second, or a negative value on failure
+static double run(FILE *out, const bench_mode_t *mode, int nthreads, uint64_t calls,
+                  double single_rate) {
+  worker_t *workers = (worker_t *)calloc((size_t)nthreads, sizeof(worker_t));
+  pthread_t *threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+  uint64_t *latencies = (uint64_t *)malloc((size_t)nthreads * calls * sizeof(uint64_t));
+  if (!workers || !threads || !latencies) {
+    free(workers);
+    free(threads);
+    free(latencies);
+    return -1;
+  }
+
+  double rate = -1;
+  int ready = 0;
+  for (; ready < nthreads; ready++) {
+    worker_t *w = &workers[ready];
+    w->mode = mode;
+    w->id = ready;
+    w->calls = calls;
+    w->latencies = latencies + (size_t)ready * calls;
+    if (mode->setup(w) != 0)
+      goto cleanup;
+  }
+
+  pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1);
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+
+  pthread_barrier_wait(&start_barrier);
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  uint64_t elapsed = bench_now_ns() - start;
+  pthread_barrier_destroy(&start_barrier);
+
+  size_t total = (size_t)nthreads * calls;
+  bench_sort_u64(latencies, total);
+  rate = (double)total * 1e9 / (double)elapsed;
+  double efficiency = single_rate > 0 ? rate / (single_rate * nthreads) : 1.0;
+
+  fprintf(out,
+          "{\"bench\":\"threads\",\"mode\":\"%s\",\"threads\":%d,\"calls\":%zu,"
+          "\"calls_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+          "\"max_ns\":%llu,\"scaling_efficiency\":%.3f}\n",
+          mode->name, nthreads, total, rate,
+          (unsigned long long)bench_quantile(latencies, total, 0.50),
+          (unsigned long long)bench_quantile(latencies, total, 0.99),
+          (unsigned long long)bench_quantile(latencies, total, 0.999),
+          (unsigned long long)latencies[total - 1], efficiency);
+  fflush(out);
+
+cleanup:
+  for (int i = 0; i < ready; i++)
+    mode->teardown(&workers[i]);
+  free(workers);
+  free(threads);
+  free(latencies);
+  return rate;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-n calls] [-T max_threads] [-m modes] [-d dir] [-o file]\n"
+          "  -n calls        calls per thread (default 20000)\n"
+          "  -T max_threads  thread counts 1,2,4,... up to this (default 64)\n"
+          "  -m modes        comma-separated: shared,separate,fdbuf,filesink,durable,mmap,rotate,\n"
+          "                  uring,direct,lz4,shard,reorder\n"
+          "  -d dir          write logs to files in dir instead of /dev/null\n"
+          "  -o file         write results to file instead of stdout\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  uint64_t calls = 20000;
+  int max_threads = 64;
+  const char *mode_filter = NULL, *out_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:T:m:d:o:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      calls = strtoull(optarg, NULL, 10);
+      break;
+    case 'T':
+      max_threads = atoi(optarg);
+      break;
+    case 'm':
+      mode_filter = optarg;
+      break;
+    case 'd':
+      out_dir = optarg;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (calls < 1)
+    calls = 1;
+  if (max_threads < 1)
+    max_threads = 1;
+
+  FILE *out = bench_open_results(out_path, stdout);
+  shared_file = open_target(-1);
+  display_flush_policy_t coalesce = {DISPLAY_FLUSH_EXIT, 64 * 1024, 1000, DISPLAY_LEVEL_NONE};
+  if (shared_file) {
+    shared_sink = display_fdbuf_open(fileno(shared_file), 0, NULL);
+    shared_file_sink = display_file_sink_open(shared_file, &coalesce);
+    if (bench_selected(mode_filter, "reorder"))
+      reorder_sink = display_reorder_open(display_fdbuf_open(fileno(shared_file), 0, NULL), 0);
+  }
+  if (bench_selected(mode_filter, "durable")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.durable.log", out_dir ? out_dir : "/tmp");
+    durable_sink = display_durable_open(path, 0, 1000);
+  }
+  if (bench_selected(mode_filter, "mmap")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.mmap.log", out_dir ? out_dir : "/tmp");
+    mmap_sink = display_mmap_open(path, 0);
+  }
+  if (bench_selected(mode_filter, "rotate")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.rotate.log", out_dir ? out_dir : "/tmp");
+    rotate_sink = display_rotate_open(path, 8 << 20, 0, rotated_unlink, NULL);
+  }
+  if (bench_selected(mode_filter, "direct")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.direct.log", out_dir ? out_dir : "/tmp");
+    direct_sink = display_direct_open(path, 0, 1);
+  }
+  if (bench_selected(mode_filter, "shard")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.shard", out_dir ? out_dir : "/tmp");
+    shard_sink = display_shard_open(path, 0, DISPLAY_SHARD_CLOCK);
+  }
+  int lz4_fd = -1;
+  if (bench_selected(mode_filter, "lz4")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.log.lz4", out_dir ? out_dir : "/tmp");
+    lz4_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    lz4_sink = lz4_fd == -1 ? NULL : display_lz4_open(lz4_fd, 0);
+  }
+  int uring_fd = -1;
+  if (bench_selected(mode_filter, "uring")) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench_threads.uring.log", out_dir ? out_dir : "/tmp");
+    uring_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    uring_sink = uring_fd == -1 ? NULL : display_uring_open(uring_fd, 0, 0, &coalesce);
+    if (uring_sink && !display_uring_active(uring_sink))
+      fprintf(stderr, "bench_threads: io_uring not available, uring uses plain writes\n");
+  }
+  if (!out || !shared_file || !shared_sink || !shared_file_sink) {
+    perror("bench_threads");
+    return 1;
+  }
+
+  for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    if (!bench_selected(mode_filter, modes[m].name))
+      continue;
+
+    double single_rate = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+      double rate = run(out, &modes[m], n, calls, single_rate);
+      if (rate < 0) {
+        fprintf(stderr, "bench_threads: %s with %d threads failed\n", modes[m].name, n);
+        break;
+      }
+      if (n == 1)
+        single_rate = rate;
+    }
+  }
+
+  display_sink_close(shared_sink);
+  display_sink_close(shared_file_sink);
+  if (durable_sink)
+    display_sink_close(durable_sink);
+  if (mmap_sink)
+    display_sink_close(mmap_sink);
+  if (rotate_sink)
+    display_sink_close(rotate_sink);
+  if (uring_sink)
+    display_sink_close(uring_sink);
+  if (direct_sink)
+    display_sink_close(direct_sink);
+  if (lz4_sink)
+    display_sink_close(lz4_sink);
+  if (shard_sink)
+    display_sink_close(shard_sink);
+  if (reorder_sink)
+    display_sink_close(reorder_sink);
+  if (lz4_fd != -1)
+    close(lz4_fd);
+  if (uring_fd != -1)
+    close(uring_fd);
+  fclose(shared_file);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
@@ -0,0 +1,97 @@
+/* gen_trace.c
+
+Generates a synthetic log trace for replay: a production-shaped mix of access-log, database,
+error and struct-heavy records with exponentially distributed inter-arrival times.
+
+Trace format (text, one record per line, fields separated by tabs):
+  <timestamp_ns> <format> <arg>...
+where every argument is prefixed with its kind:
+  i:<signed>  u:<unsigned>  f:<double>  s:<string>  p:<hex pointer>  o:<text of a {} struct>
+Tabs, newlines and backslashes inside formats and strings are escaped as \t, \n and \\.
+Lines starting with '#' are comments.
+
+Usage: gen_trace [-n records] [-r records_per_sec] [-s seed] > trace.txt
+
+*/
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t rng_state = 0x2545F4914F6CDD1Dull;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static unsigned rng_below(unsigned n) { return (unsigned)(rng() % n); }
+
+static double rng_unit(void) { return (double)(rng() >> 11) / 9007199254740992.0; }
+
+static const char *const paths[] = {"/", "/index.html", "/api/v1/users", "/api/v1/orders/checkout",
+                                    "/static/app.js", "/healthz"};
+static const char *const methods[] = {"GET", "GET", "GET", "POST", "PUT", "DELETE"};
+static const char *const tables[] = {"users", "orders", "sessions", "inventory"};
+static const char *const errors[] = {"connection reset by peer", "timeout waiting for upstream",
+                                     "invalid token", "disk quota exceeded"};
+
+int main(int argc, char **argv) {
+  uint64_t records = 100000;
+  double rate = 50000.0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:s:h")) != -1) {
+    switch (opt) {
+    case 'n':
+      records = strtoull(optarg, NULL, 10);
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 's':
+      rng_state = strtoull(optarg, NULL, 0) | 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-n records] [-r records_per_sec] [-s seed]\n", argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (rate <= 0)
+    rate = 1;
+
+  printf("# display trace v1: %llu records at ~%.0f records/s\n", (unsigned long long)records,
+         rate);
+
+  double t = 0;
+  for (uint64_t n = 0; n < records; n++) {
+    t += -log(1.0 - rng_unit()) / rate * 1e9;
+    printf("%.0f\t", t);
+
+    unsigned kind = rng_below(100);
+    if (kind < 60) {
+      unsigned m = rng_below(6);
+      printf("%%s %%s %%d %%zu bytes in %%.3f ms\ts:%s\ts:%s\ti:%d\tu:%u\tf:%.6f\n", methods[m],
+             paths[rng_below(6)], rng_below(10) ? 200 : 404 + (int)rng_below(2) * 96,
+             rng_below(1 << 16), rng_unit() * 40.0);
+    } else if (kind < 80) {
+      printf("db query on %%s: rows=%%ld elapsed=%%gus conn=%%p\ts:%s\ti:%u\tf:%.2f\tp:%llx\n",
+             tables[rng_below(4)], rng_below(5000), rng_unit() * 1e4,
+             (unsigned long long)(rng() & 0x7ffffffff000ull));
+    } else if (kind < 90) {
+      printf("ERROR [%%08x] request %%llu failed: %%s (retry %%d/%%d)"
+             "\tu:%u\tu:%llu\ts:%s\ti:%u\ti:3\n",
+             (unsigned)rng(), (unsigned long long)(rng() >> 20), errors[rng_below(4)],
+             rng_below(4));
+    } else {
+      printf("session {} moved from {} to {} at t=%%.1f\to:user#%u\to:(%d,%d)\to:(%d,%d)\tf:%.1f\n",
+             rng_below(100000), (int)rng_below(1000), (int)rng_below(1000), (int)rng_below(1000),
+             (int)rng_below(1000), t / 1e6);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* perf_counters.h
+
+Hardware performance counters for the benchmarks through perf_event_open (Linux only).
+The counters are opened as one group (cycles as the leader) so they are scheduled together,
+and the values are scaled when the kernel had to multiplex the group.
+
+Only user-space events are counted, which keeps instruction counts stable across runs and
+allowed with the default perf_event_paranoid setting.
+
+*/
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+
+enum {
+  BENCH_CYCLES,
+  BENCH_INSTRUCTIONS,
+  BENCH_BRANCH_MISSES,
+  BENCH_L1D_MISSES,
+  BENCH_LLC_MISSES,
+  BENCH_NCOUNTERS,
+};
+
+static const char *const bench_counter_names[BENCH_NCOUNTERS] = {
+    "cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses",
+};
+
+typedef struct bench_counters_t {
+  int fds[BENCH_NCOUNTERS]; // -1 for counters the CPU/kernel does not provide
+  int slot[BENCH_NCOUNTERS]; // Position of each counter in the group read
+  int nopen;
+
+} bench_counters_t;
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline int bench_perf_open(uint32_t type, uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+      PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/// @brief Opens the counter group for the calling thread
+/// @return 0 on success, -1 if not even the cycle counter is available
+static inline int bench_counters_open(bench_counters_t *c) {
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } events[BENCH_NCOUNTERS] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+  };
+
+  c->nopen = 0;
+  for (int i = 0; i < BENCH_NCOUNTERS; i++) {
+    c->fds[i] = bench_perf_open(events[i].type, events[i].config, i == 0 ? -1 : c->fds[0]);
+    c->slot[i] = c->fds[i] >= 0 ? c->nopen++ : -1;
+    if (i == 0 && c->fds[0] < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static inline void bench_counters_close(bench_counters_t *c) {
+  for (int i = 0; i < BENCH_NCOUNTERS; i++)
+    if (c->fds[i] >= 0)
+      close(c->fds[i]);
+}
+
+static inline void bench_counters_start(bench_counters_t *c) {
+  ioctl(c->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(c->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/// @brief Stops the group and stores the (multiplexing-scaled) counts, -1 for unavailable ones
+/// @return 0 on success, -1 on failure
+static inline int bench_counters_stop(bench_counters_t *c, double out[BENCH_NCOUNTERS]) {
+  ioctl(c->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // Layout: nr, time_enabled, time_running, value[nr]
+  uint64_t data[3 + BENCH_NCOUNTERS];
+  if (read(c->fds[0], data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t)))
+    return -1;
+
+  double scale = data[2] ? (double)data[1] / (double)data[2] : 0.0;
+  for (int i = 0; i < BENCH_NCOUNTERS; i++)
+    out[i] = c->slot[i] >= 0 ? (double)data[3 + c->slot[i]] * scale : -1.0;
+
+  return 0;
+}
+
+#else
+
+static inline int bench_counters_open(bench_counters_t *c) {
+  (void)c;
+  return -1;
+}
+
+static inline void bench_counters_close(bench_counters_t *c) { (void)c; }
+
+static inline void bench_counters_start(bench_counters_t *c) { (void)c; }
+
+static inline int bench_counters_stop(bench_counters_t *c, double out[BENCH_NCOUNTERS]) {
+  (void)c;
+  (void)out;
+  return -1;
+}
+
+#endif // __linux__
+
+#endif // PERF_COUNTERS_H
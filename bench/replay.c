@@ -0,0 +1,555 @@
+/* replay.c
+
+Replays a captured log trace (see gen_trace.c for the format) through display.h, either at
+full speed or at the recorded rate, and reports throughput, per-record latency percentiles and
+output bytes for each sink.
+
+Sinks:
+  stdout    display_println to stdout
+  file      display_fprintln to a FILE opened on the -O path
+  fd        display_snprintln into a buffer, then write(2) on the -O path
+  fdbuf     display_sinkprintln to a display_fdbuf_open sink on the -O path
+  nonblock  display_sinkprintln to a display_nonblock_open sink on the -O path, dropping what
+            a slow reader does not take (point -O at a FIFO); dropped records are reported
+  string    display_snprintln only, measuring formatting alone
+
+Records are dispatched to real typed calls: integer conversions are rewritten to the `ll`
+length (values cast to the original width at load), %c becomes %s over a one-character string
+and floating conversions take a double. Strings, pointers and {} structs are passed as
+pointers. Records using %n, %b or '*' widths are skipped.
+
+Results are written as one JSON object per line, to stderr unless -o is given:
+  {"bench":"replay","sink":"file","records":...,"records_per_sec":...,"p99_ns":...}
+
+Usage: replay [-s sinks] [-O path] [-R] [-x speed] [-l loops] [-o file] trace.txt
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include "bench.h"
+
+#include <errno.h>
+#include <getopt.h>
+
+#define REPLAY_MAX_ARGS 5
+
+typedef union replay_arg_t {
+  long long i;
+  double f;
+  const void *p;
+
+} replay_arg_t;
+
+typedef struct replay_record_t {
+  uint64_t t_ns;
+  char *fmt;
+  uint32_t code; // Argument kinds, see Dispatch
+  int nargs;
+  replay_arg_t args[REPLAY_MAX_ARGS];
+  size_t bytes; // Output length, newline included
+
+} replay_record_t;
+
+/// @brief Displayable carrying the text recorded for a {} argument
+typedef struct replay_obj_t {
+  display_t d;
+  char *text;
+
+} replay_obj_t;
+
+static int display_obj(const void *self) {
+  return printf("%s", ((const replay_obj_t *)self)->text);
+}
+
+static int fdisplay_obj(const void *self, FILE *file) {
+  return fputs(((const replay_obj_t *)self)->text, file) < 0 ? -1 : 0;
+}
+
+static int sndisplay_obj(const void *self, char *buf, size_t size) {
+  return snprintf(buf, size, "%s", ((const replay_obj_t *)self)->text);
+}
+
+/*---------------------------Dispatch----------------------------*/
+
+// Every argument list of up to REPLAY_MAX_ARGS arguments of the kinds long long (1), double (2)
+// and pointer (3) gets its own typed call. `code` starts at 1 and gains one base-4 digit per
+// argument, so lists of different lengths never collide.
+#define R_KIND_I 1
+#define R_KIND_F 2
+#define R_KIND_P 3
+#define R_UNPACK(...) __VA_ARGS__
+#define R_CASE(code, args)                                                                         \
+  case code:                                                                                       \
+    return REPLAY_CALL args;
+// A macro cannot expand inside its own expansion, so every depth has its own pair of macros
+#define R_D5(code, args) R_CASE(code, args)
+#define R_D4(code, args)                                                                           \
+  R_CASE(code, args)                                                                               \
+  R_D5((code) * 4 + R_KIND_I, (R_UNPACK args, a[4].i))                                             \
+  R_D5((code) * 4 + R_KIND_F, (R_UNPACK args, a[4].f))                                             \
+  R_D5((code) * 4 + R_KIND_P, (R_UNPACK args, a[4].p))
+#define R_D3(code, args)                                                                           \
+  R_CASE(code, args)                                                                               \
+  R_D4((code) * 4 + R_KIND_I, (R_UNPACK args, a[3].i))                                             \
+  R_D4((code) * 4 + R_KIND_F, (R_UNPACK args, a[3].f))                                             \
+  R_D4((code) * 4 + R_KIND_P, (R_UNPACK args, a[3].p))
+#define R_D2(code, args)                                                                           \
+  R_CASE(code, args)                                                                               \
+  R_D3((code) * 4 + R_KIND_I, (R_UNPACK args, a[2].i))                                             \
+  R_D3((code) * 4 + R_KIND_F, (R_UNPACK args, a[2].f))                                             \
+  R_D3((code) * 4 + R_KIND_P, (R_UNPACK args, a[2].p))
+#define R_D1(code, args)                                                                           \
+  R_CASE(code, args)                                                                               \
+  R_D2((code) * 4 + R_KIND_I, (R_UNPACK args, a[1].i))                                             \
+  R_D2((code) * 4 + R_KIND_F, (R_UNPACK args, a[1].f))                                             \
+  R_D2((code) * 4 + R_KIND_P, (R_UNPACK args, a[1].p))
+#define R_D0(code, args)                                                                           \
+  R_CASE(code, args)                                                                               \
+  R_D1((code) * 4 + R_KIND_I, (R_UNPACK args, a[0].i))                                             \
+  R_D1((code) * 4 + R_KIND_F, (R_UNPACK args, a[0].f))                                             \
+  R_D1((code) * 4 + R_KIND_P, (R_UNPACK args, a[0].p))
+
+static FILE *replay_file;
+static display_sink_t *replay_sink;
+static char replay_buf[1 << 16];
+
+#define REPLAY_CALL(...) display_println(__VA_ARGS__)
+static int dispatch_println(uint32_t code, const char *fmt, const replay_arg_t *a) {
+  switch (code) { R_D0(1, (fmt)) }
+  return -1;
+}
+#undef REPLAY_CALL
+
+#define REPLAY_CALL(...) display_fprintln(replay_file, __VA_ARGS__)
+static int dispatch_fprintln(uint32_t code, const char *fmt, const replay_arg_t *a) {
+  switch (code) { R_D0(1, (fmt)) }
+  return -1;
+}
+#undef REPLAY_CALL
+
+#define REPLAY_CALL(...) display_snprintln(replay_buf, sizeof(replay_buf), __VA_ARGS__)
+static int dispatch_snprintln(uint32_t code, const char *fmt, const replay_arg_t *a) {
+  switch (code) { R_D0(1, (fmt)) }
+  return -1;
+}
+#undef REPLAY_CALL
+
+#define REPLAY_CALL(...) display_sinkprintln(replay_sink, __VA_ARGS__)
+static int dispatch_sinkprintln(uint32_t code, const char *fmt, const replay_arg_t *a) {
+  switch (code) { R_D0(1, (fmt)) }
+  return -1;
+}
+#undef REPLAY_CALL
+
+/*---------------------------Dispatch----------------------------*/
+
+/*----------------------------Loading----------------------------*/
+
+/// @brief Unescapes \t, \n and \\ in place
+static void unescape(char *s) {
+  char *out = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1]) {
+      s++;
+      *out++ = *s == 't' ? '\t' : *s == 'n' ? '\n' : *s;
+    } else {
+      *out++ = *s;
+    }
+  }
+  *out = '\0';
+}
+
+/// @brief Rewrites the format of a record for the typed dispatch and converts its arguments
+/// @return 0 on success, -1 if the record cannot be replayed
+static int prepare(replay_record_t *r, char kinds[REPLAY_MAX_ARGS], char *raw[REPLAY_MAX_ARGS]) {
+  size_t cap = strlen(r->fmt) * 2 + 1;
+  char *fmt = (char *)malloc(cap), *out = fmt;
+  const char *p = r->fmt;
+  int arg = 0;
+  if (!fmt)
+    return -1;
+
+  r->code = 1;
+  while (*p) {
+    if (*p == '{' && p[1] == '}') {
+      if (arg >= r->nargs || kinds[arg] != 'o')
+        goto fail;
+
+      replay_obj_t *obj = (replay_obj_t *)malloc(sizeof(replay_obj_t));
+      if (!obj)
+        goto fail;
+      obj->d = (display_t){display_obj, fdisplay_obj, sndisplay_obj, obj};
+      obj->text = raw[arg];
+      r->args[arg++].p = obj; // Read back as display_t *, which obj starts with
+      r->code = r->code * 4 + R_KIND_P;
+      *out++ = *p++;
+      *out++ = *p++;
+      continue;
+    }
+    if (*p != '%') {
+      *out++ = *p++;
+      continue;
+    }
+    if (p[1] == '%') {
+      *out++ = *p++;
+      *out++ = *p++;
+      continue;
+    }
+
+    // Flags, width and precision are copied as they are
+    const char *start = p++;
+    while (*p && strchr("-+ #0", *p))
+      p++;
+    while (*p >= '0' && *p <= '9')
+      p++;
+    if (*p == '.') {
+      p++;
+      while (*p >= '0' && *p <= '9')
+        p++;
+    }
+    memcpy(out, start, (size_t)(p - start));
+    out += p - start;
+
+    char length[3] = {0};
+    for (int n = 0; n < 2 && *p && strchr("hljztL", *p); n++)
+      length[n] = *p++;
+
+    char conv = *p;
+    if (!conv || arg >= r->nargs)
+      goto fail;
+    p++;
+    char kind = kinds[arg];
+    replay_arg_t *a = &r->args[arg++];
+
+    if (conv && strchr("diouxX", conv)) {
+      if (kind != 'i' && kind != 'u')
+        goto fail;
+      unsigned long long v = strtoull(raw[arg - 1], NULL, 0);
+      int is_signed = conv == 'd' || conv == 'i';
+      if (strcmp(length, "hh") == 0)
+        a->i = is_signed ? (signed char)v : (long long)(unsigned char)v;
+      else if (strcmp(length, "h") == 0)
+        a->i = is_signed ? (short)v : (long long)(unsigned short)v;
+      else if (length[0] == '\0')
+        a->i = is_signed ? (int)v : (long long)(unsigned)v;
+      else
+        a->i = (long long)v;
+
+      *out++ = 'l';
+      *out++ = 'l';
+      *out++ = conv;
+      r->code = r->code * 4 + R_KIND_I;
+    } else if (conv == 'c') {
+      if (kind != 'i' && kind != 'u')
+        goto fail;
+      char *one = (char *)malloc(2);
+      if (!one)
+        goto fail;
+      one[0] = (char)strtol(raw[arg - 1], NULL, 0);
+      one[1] = '\0';
+      a->p = one;
+      *out++ = 's';
+      r->code = r->code * 4 + R_KIND_P;
+    } else if (conv && strchr("eEfFgGaA", conv)) {
+      if (kind != 'f')
+        goto fail;
+      a->f = strtod(raw[arg - 1], NULL);
+      *out++ = conv;
+      r->code = r->code * 4 + R_KIND_F;
+    } else if (conv == 's' || conv == 'p') {
+      if (kind != (conv == 's' ? 's' : 'p'))
+        goto fail;
+      a->p = conv == 's' ? (const void *)raw[arg - 1]
+                         : (const void *)(uintptr_t)strtoull(raw[arg - 1], NULL, 16);
+      *out++ = conv;
+      r->code = r->code * 4 + R_KIND_P;
+    } else {
+      goto fail; // %n, %b, '*' or an invalid conversion
+    }
+  }
+  *out = '\0';
+
+  if (arg != r->nargs)
+    goto fail;
+
+  r->fmt = fmt;
+  return 0;
+
+fail:
+  free(fmt);
+  return -1;
+}
+
+/// @brief Loads and prepares every record of a trace file
+/// @return The number of records, or -1 on failure
+static long load(const char *path, replay_record_t **records_out, long *skipped) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  size_t cap = 1024, count = 0;
+  replay_record_t *records = (replay_record_t *)malloc(cap * sizeof(replay_record_t));
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len;
+  *skipped = 0;
+
+  while (records && (len = getline(&line, &line_cap, f)) > 0) {
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    char *copy = strdup(line), *save = NULL;
+    char *ts = strtok_r(copy, "\t", &save);
+    char *fmt = strtok_r(NULL, "\t", &save);
+    if (!ts || !fmt) {
+      free(copy);
+      (*skipped)++;
+      continue;
+    }
+
+    replay_record_t r = {0};
+    char kinds[REPLAY_MAX_ARGS], *raw[REPLAY_MAX_ARGS];
+    char *field;
+    r.t_ns = strtoull(ts, NULL, 10);
+    r.fmt = fmt;
+    unescape(r.fmt);
+    while ((field = strtok_r(NULL, "\t", &save)) && r.nargs < REPLAY_MAX_ARGS + 1) {
+      if (r.nargs == REPLAY_MAX_ARGS || strlen(field) < 2 || field[1] != ':') {
+        r.nargs = -1;
+        break;
+      }
+      kinds[r.nargs] = field[0];
+      raw[r.nargs] = field + 2;
+      unescape(raw[r.nargs]);
+      r.nargs++;
+    }
+
+    if (r.nargs < 0 || prepare(&r, kinds, raw) != 0) {
+      free(copy);
+      (*skipped)++;
+      continue;
+    }
+
+    int n = dispatch_snprintln(r.code, r.fmt, r.args);
+    r.bytes = n > 0 ? (size_t)n : 0;
+
+    if (count == cap) {
+      cap *= 2;
+      records = (replay_record_t *)realloc(records, cap * sizeof(replay_record_t));
+      if (!records)
+        break;
+    }
+    records[count++] = r;
+  }
+
+  free(line);
+  fclose(f);
+  *records_out = records;
+  return records ? (long)count : -1;
+}
+
+/*----------------------------Loading----------------------------*/
+
+typedef struct replay_sink_t {
+  const char *name;
+  int (*emit)(const replay_record_t *r);
+  display_sink_t *(*open)(void); // For display_sink_t sinks, opened for the run only
+
+} replay_sink_t;
+
+static int replay_fd = -1;
+
+static int emit_stdout(const replay_record_t *r) {
+  return dispatch_println(r->code, r->fmt, r->args);
+}
+
+static int emit_file(const replay_record_t *r) {
+  return dispatch_fprintln(r->code, r->fmt, r->args);
+}
+
+static int emit_fd(const replay_record_t *r) {
+  int n = dispatch_snprintln(r->code, r->fmt, r->args);
+  if (n <= 0)
+    return n;
+
+  size_t len = (size_t)n < sizeof(replay_buf) ? (size_t)n : sizeof(replay_buf) - 1;
+  const char *p = replay_buf;
+  while (len > 0) {
+    ssize_t w = write(replay_fd, p, len);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0)
+      return -1;
+    p += w;
+    len -= (size_t)w;
+  }
+  return n;
+}
+
+static int emit_string(const replay_record_t *r) {
+  return dispatch_snprintln(r->code, r->fmt, r->args);
+}
+
+static int emit_sink(const replay_record_t *r) {
+  return dispatch_sinkprintln(r->code, r->fmt, r->args);
+}
+
+static display_sink_t *open_fdbuf(void) { return display_fdbuf_open(replay_fd, 0, NULL); }
+
+static display_sink_t *open_nonblock(void) {
+  return display_nonblock_open(replay_fd, 0, DISPLAY_OVERFLOW_DROP, 100, 1);
+}
+
+static const replay_sink_t sinks[] = {
+    {"stdout", emit_stdout, NULL},    {"file", emit_file, NULL},
+    {"fd", emit_fd, NULL},            {"string", emit_string, NULL},
+    {"fdbuf", emit_sink, open_fdbuf}, {"nonblock", emit_sink, open_nonblock},
+};
+
+static void wait_until(uint64_t deadline_ns) {
+  uint64_t now = bench_now_ns();
+  if (deadline_ns > now + 50000) { // Sleep for long gaps, spin for short ones
+    uint64_t ns = deadline_ns - now - 50000;
+    struct timespec ts = {(time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull)};
+    nanosleep(&ts, NULL);
+  }
+  while (bench_now_ns() < deadline_ns)
+    ;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "Usage: %s [-s sinks] [-O path] [-R] [-x speed] [-l loops] [-o file] trace.txt\n"
+          "  -s sinks   comma-separated: stdout,file,fd,string,fdbuf,nonblock\n"
+          "             (default file,fd,string,fdbuf)\n"
+          "  -O path    destination of the file, fd, fdbuf and nonblock sinks (default /dev/null)\n"
+          "  -R         replay at the recorded rate instead of full speed\n"
+          "  -x speed   rate multiplier for -R (default 1.0)\n"
+          "  -l loops   replay the trace this many times per sink (default 1)\n"
+          "  -o file    write results to file instead of stderr\n",
+          argv0);
+}
+
+int main(int argc, char **argv) {
+  const char *sink_filter = "file,fd,string,fdbuf", *dest = "/dev/null", *out_path = NULL;
+  int recorded_rate = 0, loops = 1;
+  double speed = 1.0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:O:Rx:l:o:h")) != -1) {
+    switch (opt) {
+    case 's':
+      sink_filter = optarg;
+      break;
+    case 'O':
+      dest = optarg;
+      break;
+    case 'R':
+      recorded_rate = 1;
+      break;
+    case 'x':
+      speed = strtod(optarg, NULL);
+      break;
+    case 'l':
+      loops = atoi(optarg);
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (loops < 1)
+    loops = 1;
+  if (speed <= 0)
+    speed = 1.0;
+
+  replay_record_t *records;
+  long skipped;
+  long count = load(argv[optind], &records, &skipped);
+  if (count < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if (count == 0) {
+    fprintf(stderr, "replay: no replayable records (%ld skipped)\n", skipped);
+    return 1;
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stderr;
+  replay_file = fopen(dest, "w");
+  replay_fd = open(dest, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  uint64_t *latencies = (uint64_t *)malloc((size_t)count * loops * sizeof(uint64_t));
+  if (!out || !replay_file || replay_fd < 0 || !latencies) {
+    perror("replay");
+    return 1;
+  }
+
+  for (size_t s = 0; s < sizeof(sinks) / sizeof(sinks[0]); s++) {
+    if (!bench_selected(sink_filter, sinks[s].name))
+      continue;
+    replay_sink = sinks[s].open ? sinks[s].open() : NULL;
+    if (sinks[s].open && !replay_sink) {
+      fprintf(stderr, "replay: cannot open the %s sink\n", sinks[s].name);
+      continue;
+    }
+
+    uint64_t bytes = 0, t0 = records[0].t_ns;
+    size_t n = 0;
+    uint64_t start = bench_now_ns();
+    for (int l = 0; l < loops; l++) {
+      uint64_t loop_start = bench_now_ns();
+      for (long i = 0; i < count; i++) {
+        const replay_record_t *r = &records[i];
+        if (recorded_rate)
+          wait_until(loop_start + (uint64_t)((double)(r->t_ns - t0) / speed));
+
+        uint64_t c0 = bench_now_ns();
+        sinks[s].emit(r);
+        latencies[n++] = bench_now_ns() - c0;
+        bytes += r->bytes;
+      }
+    }
+    if (sinks[s].emit == emit_stdout)
+      fflush(stdout);
+    if (sinks[s].emit == emit_file)
+      fflush(replay_file);
+    uint64_t dropped = 0;
+    if (sinks[s].open == open_nonblock)
+      dropped = display_nonblock_dropped(replay_sink);
+    if (replay_sink)
+      display_sink_close(replay_sink);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    bench_sort_u64(latencies, n);
+    fprintf(out,
+            "{\"bench\":\"replay\",\"sink\":\"%s\",\"rate\":\"%s\",\"records\":%zu,"
+            "\"skipped\":%ld,\"dropped\":%llu,\"records_per_sec\":%.0f,\"bytes\":%llu,"
+            "\"bytes_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+            "\"max_ns\":%llu}\n",
+            sinks[s].name, recorded_rate ? "recorded" : "max", n, skipped,
+            (unsigned long long)dropped,
+            (double)n * 1e9 / (double)elapsed, (unsigned long long)bytes,
+            (double)bytes * 1e9 / (double)elapsed,
+            (unsigned long long)bench_quantile(latencies, n, 0.50),
+            (unsigned long long)bench_quantile(latencies, n, 0.99),
+            (unsigned long long)bench_quantile(latencies, n, 0.999),
+            (unsigned long long)latencies[n - 1]);
+    fflush(out);
+  }
+
+  fclose(replay_file);
+  close(replay_fd);
+  if (out != stderr)
+    fclose(out);
+  return 0;
+}
@@ -138,10 +138,344 @@ int display_snprintln(char *buf, size_t size, const char *__restrict format, ...
 
 /*------------------------Print to string------------------------*/
 
+/*-------------------------Print to sink-------------------------*/
+
+/// @brief Severity of a record written with display_sinklog. Plain sink prints are
+/// DISPLAY_LEVEL_NONE
+#define DISPLAY_LEVEL_NONE 0
+#define DISPLAY_LEVEL_DEBUG 1
+#define DISPLAY_LEVEL_INFO 2
+#define DISPLAY_LEVEL_WARN 3
+#define DISPLAY_LEVEL_ERROR 4
+#define DISPLAY_LEVEL_FATAL 5
+
+/// @brief The base struct for output sinks. Every formatted record (println's newline
+/// included) is handed to the sink with a single write_fn call, so records written by different
+/// threads never interleave.
+/// @note  Like display_t, a concrete sink has a display_sink_t as its first field and
+/// display_sink_t::self pointing to itself. `{}` arguments are printed with sndisplay_fn
+typedef struct display_sink_t {
+  // One record of severity `level`, returns 0 on success, -1 on failure
+  int (*write_fn)(void *self, int level, const char *data, size_t len);
+  int (*flush_fn)(void *self); // Optional
+  int (*close_fn)(void *self); // Flushes and releases the sink, optional
+  void *self;
+
+} display_sink_t;
+
+/// @brief Writes one formatted record to the sink
+/// @return The number of characters written, or -1 on failure
+int display_vsinkprint(display_sink_t *sink, const char *__restrict format, va_list args);
+
+/// @brief Writes one formatted record to the sink, followed by a newline
+/// @return The number of characters written, or -1 on failure
+int display_vsinkprintln(display_sink_t *sink, const char *__restrict format, va_list args);
+
+/// @brief Writes one formatted record of severity `level` to the sink, followed by a newline
+/// @return The number of characters written, or -1 on failure
+int display_vsinklog(display_sink_t *sink, int level, const char *__restrict format,
+                     va_list args);
+
+/// @brief Writes one formatted record to the sink
+/// @return The number of characters written, or -1 on failure
+int display_sinkprint(display_sink_t *sink, const char *__restrict format, ...);
+
+/// @brief Writes one formatted record to the sink, followed by a newline
+/// @return The number of characters written, or -1 on failure
+int display_sinkprintln(display_sink_t *sink, const char *__restrict format, ...);
+
+/// @brief Writes one formatted record of severity `level` to the sink, followed by a newline
+/// @return The number of characters written, or -1 on failure
+int display_sinklog(display_sink_t *sink, int level, const char *__restrict format, ...);
+
+/// @brief Writes buffered data of the sink to its destination
+/// @return 0 on success, -1 on failure
+int display_sink_flush(display_sink_t *sink);
+
+/// @brief Flushes and releases the sink
+/// @return 0 on success, -1 on failure
+int display_sink_close(display_sink_t *sink);
+
+/// @brief A destination of a tee sink. Records below `min_level` are not written to it, records
+/// without a level (DISPLAY_LEVEL_NONE) only if `min_level` is DISPLAY_LEVEL_NONE
+typedef struct display_tee_child_t {
+  display_sink_t *sink;
+  int min_level;
+
+} display_tee_child_t;
+
+/// @brief Opens a sink writing every record to `count` child sinks. A record is formatted once,
+/// `{}` arguments included, and the same bytes are handed to each child that accepts its level
+/// @return The sink, or NULL on failure. Closing it closes the children
+display_sink_t *display_tee_open(const display_tee_child_t *children, size_t count);
+
+#define DISPLAY_FRAME_HEADER 8 // Bytes before each framed record
+
+/// @brief Opens a sink that frames every record for crash recovery before writing it to
+/// `inner` (a file, fd buffer or mmap sink): a 4-byte little-endian length, a 4-byte CRC32C of
+/// the length and the record, then the record. See display_frame_next to read them back
+/// @return The sink, or NULL on failure. Closing it closes `inner`
+display_sink_t *display_framed_open(display_sink_t *inner);
+
+/// @brief Reads the next framed record of `buf` from `*pos` on, skipping bytes that do not form
+/// a valid frame, such as a record torn by a crash or preallocated space
+/// @return 1 with the record in `*record` and `*len` and `*pos` moved past it, or 0 when no
+/// valid frame is left. Skipped bytes are added to `*skipped`, if not NULL
+int display_frame_next(const char *buf, size_t size, size_t *pos, const char **record,
+                       size_t *len, size_t *skipped);
+
+/// @brief CRC32C (Castagnoli) of `len` bytes continuing from `crc`, 0 to start. Uses the SSE4.2
+/// crc32 instruction when the CPU has it
+uint32_t display_crc32c(uint32_t crc, const void *data, size_t len);
+
+#ifndef _WIN32
+
+/// @brief Flags of a flush policy
+#define DISPLAY_FLUSH_AUTO 0u    // NEWLINE and EXIT on a tty, EXIT otherwise
+#define DISPLAY_FLUSH_NEWLINE 1u // After every record containing a newline
+#define DISPLAY_FLUSH_EXIT 2u    // At exit, through atexit
+#define DISPLAY_FLUSH_TIMER 4u   // Check max_age_us from a background thread as well as on writes
+
+/// @brief When a buffered sink writes its buffer out, besides when it is full. A NULL policy is
+/// DISPLAY_FLUSH_AUTO with no other limit
+typedef struct display_flush_policy_t {
+  unsigned flags;      // DISPLAY_FLUSH_*
+  size_t max_bytes;    // Flush once this many bytes are pending, 0 for no limit
+  unsigned max_age_us; // Flush once the oldest pending byte is this old, 0 for no limit
+  int min_level;       // Flush after records at or above this level, DISPLAY_LEVEL_NONE for never
+
+} display_flush_policy_t;
+
+/// @brief Opens a sink with its own output buffer of `capacity` bytes over a file descriptor.
+/// The buffer is written with write/writev when full and according to the flush policy.
+/// Whether `fd` is a tty is checked once, here, to resolve DISPLAY_FLUSH_AUTO
+/// @return The sink, or NULL on failure. The fd is not closed by display_sink_close
+display_sink_t *display_fdbuf_open(int fd, size_t capacity, const display_flush_policy_t *policy);
+
+/// @brief Opens a sink over a FILE stream: records are written with fwrite and the stream is
+/// fflush'ed according to the flush policy
+/// @return The sink, or NULL on failure. The stream is not closed by display_sink_close
+display_sink_t *display_file_sink_open(FILE *file, const display_flush_policy_t *policy);
+
+/// @brief Opens a durable sink appending to the file at `path`. Records are collected in memory
+/// and a committer thread writes them out and calls fdatasync once per batch: when
+/// `max_batch_bytes` are pending, `max_delay_us` after the first pending record, or as soon as
+/// someone waits in display_durable_wait
+/// @return The sink, or NULL on failure
+display_sink_t *display_durable_open(const char *path, size_t max_batch_bytes,
+                                     unsigned max_delay_us);
+
+/// @brief Writes one formatted record to a durable sink, followed by a newline
+/// @param ticket  Set to the sequence number of the record, to pass to display_durable_wait
+/// @return The number of characters written, or -1 on failure, and for every record once
+/// writing or syncing the file has failed
+int display_durable_println(display_sink_t *sink, uint64_t *ticket,
+                            const char *__restrict format, ...);
+
+/// @brief Waits until the record with `ticket`, and all records before it, are on stable storage
+/// @return 0 on success, -1 if writing or syncing the file failed
+int display_durable_wait(display_sink_t *sink, uint64_t ticket);
+
+/// @brief What a non-blocking sink does with a record its pending buffer has no room for
+#define DISPLAY_OVERFLOW_DROP 0  // Drop it and count it, see display_nonblock_dropped
+#define DISPLAY_OVERFLOW_BLOCK 1 // Wait up to `block_timeout_ms` for room, then drop it
+
+/// @brief Opens a sink over a pipe or socket that never blocks the caller indefinitely. `fd` is
+/// switched to O_NONBLOCK; what the reader does not accept is kept in a buffer of `capacity`
+/// bytes and drained on later writes, or by a helper thread if `helper` is set
+/// @return The sink, or NULL on failure. The fd is not closed by display_sink_close, its flags
+/// are restored
+/// @note  Once writing fails for another reason than a full fd, e.g. EPIPE when the reader is
+///        gone, the buffer is discarded and every later write, flush and close returns -1
+display_sink_t *display_nonblock_open(int fd, size_t capacity, int overflow,
+                                      unsigned block_timeout_ms, int helper);
+
+/// @brief The number of records a non-blocking sink dropped so far
+uint64_t display_nonblock_dropped(display_sink_t *sink);
+
+/// @brief Opens a sink appending to memory-mapped segment files `<path>.0`, `<path>.1`, ... of
+/// `segment_size` bytes each, preallocated with posix_fallocate. Writers reserve their range
+/// with one atomic add and copy the record into the mapping, without a syscall. A full segment
+/// is truncated to its used length, unmapped, and the next one is started
+/// @return The sink, or NULL on failure. Records longer than `segment_size` are rejected
+display_sink_t *display_mmap_open(const char *path, size_t segment_size);
+
+/// @brief Opens a sink appending to the file at `path` that is rotated once it holds
+/// `max_bytes` bytes or is `max_age_s` seconds old (0 disables either). A background thread
+/// renames it to `<path>.<n>` and opens a new `path`, producers switch to the new file through
+/// an atomic swap and never wait on the filesystem. `on_rotated`, if not NULL, is then called
+/// from that thread with the rotated file name, e.g. to compress it
+/// @return The sink, or NULL on failure
+/// @note  A rotation that fails is retried after 1 s, then after twice as long each time up to
+///        a minute. Until one succeeds, writes still reach the current file but return -1
+display_sink_t *display_rotate_open(const char *path, size_t max_bytes, unsigned max_age_s,
+                                    void (*on_rotated)(const char *rotated_path, void *arg),
+                                    void *arg);
+
+/// @brief Opens a sink writing the file at `path` (created or truncated) with O_DIRECT, so
+/// that high-volume output does not evict the page cache. Records are packed into aligned
+/// blocks of `block_size` bytes (a multiple of 4096, default 1 MiB) and only whole blocks are
+/// written. With `double_buffer`, a background thread writes a full block while the next one is
+/// filled. display_sink_flush and display_sink_close write the partial last block padded to
+/// the alignment and truncate the file back to its length
+/// @return The sink, or NULL on failure. On filesystems without O_DIRECT (e.g. tmpfs), the same
+/// blocks go through the page cache
+/// @note glibc declares O_DIRECT only if _GNU_SOURCE is defined before the first #include,
+/// otherwise the page cache is used as well
+display_sink_t *display_direct_open(const char *path, size_t block_size, int double_buffer);
+
+/// @brief Opens a sink writing an LZ4 frame to `fd`, readable by `lz4 -d` and other LZ4 frame
+/// decoders. Records are collected into blocks of `block_size` bytes (64 KiB, 256 KiB, 1 MiB or
+/// 4 MiB, default 64 KiB), each compressed independently and checksummed by a background thread
+/// while producers fill the next block. display_sink_flush ends the current block early and
+/// waits for it to be written
+/// @return The sink, or NULL on failure. display_sink_close writes the end mark but does not
+/// close `fd`
+display_sink_t *display_lz4_open(int fd, size_t block_size);
+
+/// @brief Opens a buffered sink over `fd` whose flushes are queued to io_uring instead of
+/// calling write(2), so the thread that logs never waits on the file. Up to `queue_depth`
+/// buffers of `buffer_size` bytes are registered with the kernel; full ones are submitted, kept
+/// in flight and recycled as they complete. Flushing follows `policy` as for
+/// display_fdbuf_open, and display_sink_flush waits for all writes to complete
+/// @return The sink, or NULL on failure. Without DISPLAY_IO_URING, or if the kernel refuses
+/// io_uring, the sink works the same but flushes with plain writes
+/// @note Defining DISPLAY_IO_URING needs Linux 5.6 and <linux/io_uring.h>
+display_sink_t *display_uring_open(int fd, size_t buffer_size, unsigned queue_depth,
+                                   const display_flush_policy_t *policy);
+
+/// @brief Whether a sink from display_uring_open writes through io_uring (1) or fell back to
+/// plain writes (0)
+int display_uring_active(display_sink_t *sink);
+
+/// @brief An entry of a sidecar index: the record number `seq` (counted from 0 when the sink
+/// was opened) was written at `time_ns` (CLOCK_REALTIME) and starts at `offset` in the file
+typedef struct display_index_entry_t {
+  uint64_t time_ns;
+  uint64_t seq;
+  uint64_t offset;
+
+} display_index_entry_t;
+
+/// @brief Keys display_index_seek can look up
+#define DISPLAY_INDEX_TIME 0 // display_index_entry_t::time_ns
+#define DISPLAY_INDEX_SEQ 1  // display_index_entry_t::seq
+
+/// @brief Opens a sink writing to `inner`, the sink of a single file (fd buffer, file, durable,
+/// direct, io_uring), and appending an entry to the sparse index at `index_path` every
+/// `every_records` records or `every_bytes` bytes (0 disables either). Offsets count the bytes
+/// handed to `inner`, from `base_offset`, the size of the file when it was opened. Wrap it with
+/// display_framed_open, not the other way round, for offsets of frames
+/// @return The sink, or NULL on failure. Closing it closes `inner`
+/// @note If an index entry cannot be written, records still reach `inner` but no further
+/// entries are added, and every later write, flush and close returns -1
+display_sink_t *display_indexed_open(display_sink_t *inner, const char *index_path,
+                                     uint64_t base_offset, unsigned every_records,
+                                     size_t every_bytes);
+
+/// @brief Finds in the index at `index_path` the last entry whose `key` (DISPLAY_INDEX_TIME or
+/// DISPLAY_INDEX_SEQ) is at most `value`, and the entry after it, with a binary search. The
+/// records with keys up to `value` start before `at->offset`, and those after it from
+/// `after->offset` on
+/// @return 1 with the entry in `*at`, 0 if every entry is after `value`, -1 on failure. `*after`,
+/// if not NULL, gets the next entry, or an offset of UINT64_MAX if there is none
+int display_index_seek(const char *index_path, int key, uint64_t value, display_index_entry_t *at,
+                       display_index_entry_t *after);
+
+/// @brief How a sharded sink stamps records, for display_merge to order them
+#define DISPLAY_SHARD_CLOCK 0 // CLOCK_MONOTONIC ns: threads share nothing, equal stamps may occur
+#define DISPLAY_SHARD_SEQ 1   // A global counter: exact order, but a cache line shared by threads
+
+/// @brief Opens a sink where each thread writes to its own file `<path>.<n>` through its own
+/// buffer of `capacity` bytes (see display_fdbuf_open), so that producers share no lock.
+/// Records are stamped according to `stamp`; tools/display_merge merges the files into one
+/// ordered stream. A thread's file is flushed and closed when it exits
+/// @return The sink, or NULL on failure
+/// @note Join the writing threads before closing the sink: one still exiting would close its
+/// shard after display_sink_close has freed it
+display_sink_t *display_shard_open(const char *path, size_t capacity, int stamp);
+
+/// @brief Opens a sink that writes records to `inner` in the order of their sequence numbers,
+/// starting from 0, whatever order threads produce them in. Records ahead of the next one are
+/// held in a window of `window` slots (default 1024), and a producer more than `window` ahead
+/// waits. Each contiguous run is written with one write to `inner`
+/// @return The sink, or NULL on failure. Records must be written with display_reorder_print,
+/// display_reorder_println or display_reorder_write. Closing it writes the records held after
+/// a missing one, reports -1, and closes `inner`
+display_sink_t *display_reorder_open(display_sink_t *inner, size_t window);
+
+/// @brief Writes the record with sequence number `seq` to a reorder sink
+/// @return The number of characters written, or -1 on failure or if `seq` was already written
+int display_reorder_print(display_sink_t *sink, uint64_t seq, const char *__restrict format, ...);
+
+/// @brief Writes the record with sequence number `seq` to a reorder sink, followed by a newline
+/// @return The number of characters written, or -1 on failure or if `seq` was already written
+int display_reorder_println(display_sink_t *sink, uint64_t seq, const char *__restrict format,
+                            ...);
+
+/// @brief Writes `len` bytes formatted beforehand, e.g. by display_snprint, as the record with
+/// sequence number `seq`
+/// @return 0 on success, -1 on failure or if `seq` was already written
+int display_reorder_write(display_sink_t *sink, uint64_t seq, const char *data, size_t len);
+
+/// @brief Routes display_print and display_println through a private buffer over `fd`
+/// (usually 1) instead of stdio, see display_fdbuf_open. Call it at startup, before other
+/// threads print. `{}` arguments use sndisplay_fn, falling back to display_fn with a flush
+/// @return 0 on success, -1 on failure
+int display_stdout_bypass(int fd, size_t capacity, const display_flush_policy_t *policy);
+
+/// @brief Flushes the private stdout buffer and routes display_print back through stdio
+/// @return 0 on success, -1 on failure
+int display_stdout_restore(void);
+
+#endif // _WIN32
+
 #endif // DISPLAY_H
 
 #ifdef DISPLAY_IMPLEMENTATION
 
+// Static tracepoints (USDT). They are compiled out unless DISPLAY_USDT is defined, in which case
+// <sys/sdt.h> (systemtap-sdt-dev) turns each of them into a single nop under the "display"
+// provider that bpftrace or perf can attach to:
+//   call_entry(format)                  a print function starts
+//   call_exit(format, result)           it returns; result is its return value
+//   callback_entry(format, self)        display_fn/fdisplay_fn/sndisplay_fn is called
+//   callback_exit(self, result)         it returns; result is what it reported as written
+//   flush(sink, bytes)                  a buffered sink writes `bytes` to its destination
+//   drop(sink, bytes)                   a sink drops a record of `bytes` it has no room for
+#ifdef DISPLAY_USDT
+#include <sys/sdt.h>
+#define DISPLAY_PROBE1(name, a) DTRACE_PROBE1(display, name, a)
+#define DISPLAY_PROBE2(name, a, b) DTRACE_PROBE2(display, name, a, b)
+#else
+#define DISPLAY_PROBE1(name, a) ((void)0)
+#define DISPLAY_PROBE2(name, a, b) ((void)0)
+#endif
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define DISPLAY_ESCAPE_SSE2 1
+#endif
+
+#if defined(DISPLAY_IO_URING) && defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define DISPLAY_HAS_URING 1
+#endif
+
 typedef enum var_type {
   // Floating point
   TYPE_FLOAT,       // float
@@ -186,269 +520,477 @@ typedef enum var_type {
 
 } var_type;
 
+#ifndef DISPLAY_SPEC_MAX
+#define DISPLAY_SPEC_MAX 32 // Longest specification copied as is, including '\0', see spec_compact
+#endif
+#if DISPLAY_SPEC_MAX < 32
+#error "DISPLAY_SPEC_MAX must be at least 32 to hold a compacted specification"
+#endif
+
 typedef struct format_spec_t {
-  char *substr; // The substring of the format specifier (e.g., "%d", "%.2f")
+  char substr[DISPLAY_SPEC_MAX]; // The format specifier (e.g., "%d", "%.2f")
+  size_t len;                    // Length of the specifier in the format string
   var_type type;
 
 } format_spec_t;
 
-typedef struct format_specs_array_t {
-  struct format_spec_t *data;
-  size_t count;
-
-} format_specs_array_t;
-
-static void format_specs_array_t_free(format_specs_array_t *specs) {
-  for (size_t i = 0; i < specs->count; i++)
-    free(specs->data[i].substr);
+/// @brief Appends the digits of `[p, end)` without leading zeros, or 10 nines if more than 10
+/// digits remain: that is beyond INT_MAX either way, so snprintf fails as it would on the original
+static char *spec_number(char *out, const char *p, const char *end) {
+  while (end - p > 1 && *p == '0')
+    p++;
+  if (end - p > 10) {
+    memset(out, '9', 10);
+    return out + 10;
+  }
+  memcpy(out, p, end - p);
+  return out + (end - p);
+}
 
-  free(specs->data);
+/// @brief Writes an equivalent specification to `out` for one too long to be copied: each flag
+/// once, width and precision without leading zeros. The result takes at most 1 + 5 + 10 + 11 +
+/// 2 + 1 + 1 = 31 bytes
+static void spec_compact(char *out, const char *flags, const char *width, const char *precision,
+                         const char *rest, const char *end) {
+  *out++ = '%';
+  for (const char *f = "-+ #0"; *f; f++) {
+    if (memchr(flags, *f, width - flags))
+      *out++ = *f;
+  }
+  if (*width == '*')
+    *out++ = '*';
+  else if (precision > width)
+    out = spec_number(out, width, precision);
+  if (rest > precision) {
+    *out++ = '.';
+    if (precision[1] == '*')
+      *out++ = '*';
+    else if (rest - precision > 1)
+      out = spec_number(out, precision + 1, rest);
+  }
+  memcpy(out, rest, end - rest); // Length and specifier, at most 3 bytes
+  out[end - rest] = '\0';
 }
 
-static format_specs_array_t find_format_specifiers(const char *format) {
-  int count = 0;
-  format_specs_array_t specs = {NULL, 0};
-  const char *p = format;
+/// @brief Parses the conversion specification starting at `p`, which points at a '%'
+/// @return 1 on success, 0 if `p` does not start a valid specification
+/// @note  Parsing one specification at a time keeps every print call allocation-free
+static int parse_format_spec(const char *p, format_spec_t *spec) {
+  const char *start = p;
+  p++; // Skip '%'
 
-  while (*p) {
-    if (*p == '%') {
-      // Skip %%
-      if (*(p + 1) == '%') {
-        p += 2;
-        continue;
-      }
+  // Flags: - + ' ' # 0
+  const char *flags = p;
+  while (*p && strchr("-+ #0", *p)) {
+    p++;
+  }
+  const char *width = p;
 
-      // Start substr
-      const char *start = p;
-      p++; // Skip '%'
+  // Width: numbers or *
+  if (*p == '*') {
+    p++;
+  } else {
+    while (isdigit(*p)) {
+      p++;
+    }
+  }
+  const char *precision = p;
 
-      // Flags: - + ' ' # 0
-      while (strchr("-+ #0", *p)) {
+  // Precision
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      p++;
+    } else {
+      while (isdigit(*p)) {
         p++;
       }
+    }
+  }
+  const char *rest = p;
 
-      // Width: numbers or *
-      if (*p == '*') {
-        p++;
-      } else {
-        while (isdigit(*p)) {
-          p++;
-        }
-      }
+  // Length: hh, h, l, ll, j, z, t, L
+  char length[3] = {0};
+  if (*p && strchr("hljztL", *p)) {
+    length[0] = *p;
+    p++;
+    if ((*p == 'h' || *p == 'l') && (length[0] == 'h' || length[0] == 'l')) {
+      length[1] = *p;
+      p++;
+    }
+  }
 
-      // Precision
-      if (*p == '.') {
-        p++;
-        if (*p == '*') {
-          p++;
-        } else {
-          while (isdigit(*p)) {
-            p++;
-          }
-        }
-      }
+  // Specifiers: b(boolean) d i o u x X e E f F g G a A c s p n %
+  char specifier = *p;
+  if (specifier && strchr("bdiouxXeEfFgGaAcspn%", specifier)) {
+    p++;
+  } else {
+    // Invalid specifier
+    return 0;
+  }
 
-      // Length: hh, h, l, ll, j, z, t, L
-      char length[3] = {0};
-      if (strchr("hljztL", *p)) {
-        length[0] = *p;
-        p++;
-        if ((*p == 'h' || *p == 'l') && (length[0] == 'h' || length[0] == 'l')) {
-          length[1] = *p;
-          p++;
-        }
-      }
+  size_t len = p - start;
+  if (len < DISPLAY_SPEC_MAX) {
+    memcpy(spec->substr, start, len);
+    spec->substr[len] = '\0';
+  } else {
+    spec_compact(spec->substr, flags, width, precision, rest, p);
+  }
+  spec->len = len;
 
-      // Specifiers: b(boolean) d i o u x X e E f F g G a A c s p n %
-      char specifier = *p;
-      if (strchr("bdiouxXeEfFgGaAcspn%", specifier)) {
-        p++;
-      } else {
-        // Invalid specifier
-        continue;
-      }
+  // Get type
+  enum var_type type = -1;
+  if (specifier == '%') {
+    type = TYPE_PERCENT;
+  } else if (specifier == 'p') {
+    type = TYPE_POINTER;
+  } else if (specifier == 'c') {
+    type = TYPE_INT;
+  } else if (specifier == 'b') {
+    type = TYPE_BOOL;
+  } else if (specifier == 's') {
+    type = TYPE_STRING;
+  } else if (specifier == 'n') {
+    // Reference
+    if (strcmp(length, "hh") == 0)
+      type = TYPE_POINTER_SIGNED_INT8;
+    else if (strcmp(length, "h") == 0)
+      type = TYPE_POINTER_SHORT;
+    else if (strcmp(length, "") == 0)
+      type = TYPE_POINTER_INT;
+    else if (strcmp(length, "l") == 0)
+      type = TYPE_POINTER_LONG;
+    else if (strcmp(length, "ll") == 0)
+      type = TYPE_POINTER_LONG_LONG;
+    else if (strcmp(length, "j") == 0)
+      type = TYPE_POINTER_INTMAX_T;
+    else if (strcmp(length, "z") == 0)
+      type = TYPE_POINTER_SSIZE_T;
+    else if (strcmp(length, "t") == 0)
+      type = TYPE_POINTER_PTRDIFF_T;
+    else
+      type = TYPE_POINTER_INT;
+  } else if (strchr("di", specifier)) {
+    // Signed integer
+    if (strcmp(length, "hh") == 0)
+      type = TYPE_SIGNED_INT8;
+    else if (strcmp(length, "h") == 0)
+      type = TYPE_SHORT;
+    else if (strcmp(length, "") == 0)
+      type = TYPE_INT;
+    else if (strcmp(length, "l") == 0)
+      type = TYPE_LONG;
+    else if (strcmp(length, "ll") == 0)
+      type = TYPE_LONG_LONG;
+    else if (strcmp(length, "j") == 0)
+      type = TYPE_INTMAX_T;
+    else if (strcmp(length, "z") == 0)
+      type = TYPE_SSIZE_T;
+    else if (strcmp(length, "t") == 0)
+      type = TYPE_PTRDIFF_T;
+    else
+      type = TYPE_INT;
+  } else if (strchr("ouxX", specifier)) {
+    // Unsigned integer
+    if (strcmp(length, "hh") == 0)
+      type = TYPE_UINT8;
+    else if (strcmp(length, "h") == 0)
+      type = TYPE_USHORT;
+    else if (strcmp(length, "") == 0)
+      type = TYPE_UINT;
+    else if (strcmp(length, "l") == 0)
+      type = TYPE_ULONG;
+    else if (strcmp(length, "ll") == 0)
+      type = TYPE_ULONG_LONG;
+    else if (strcmp(length, "j") == 0)
+      type = TYPE_UINTMAX_T;
+    else if (strcmp(length, "z") == 0)
+      type = TYPE_SIZE_T;
+    else if (strcmp(length, "t") == 0)
+      type = TYPE_PTRDIFF_T;
+    else
+      type = TYPE_UINT;
+  } else if (strchr("eEfFgGaA", specifier)) {
+    // Floating point
+    if (strcmp(length, "L") == 0)
+      type = TYPE_LONG_DOUBLE;
+    else
+      type = TYPE_DOUBLE;
+  } else
+    type = TYPE_NONE;
 
-      size_t len = p - start;
-      char *sub = (char *)malloc(len + 1);
-      if (!sub) {
-        // Buy more ram wtf
-        continue;
-      }
+  spec->type = type;
+  return type != TYPE_NONE;
+}
 
-      strncpy(sub, start, len);
-      sub[len] = '\0';
-
-      // Get type
-      enum var_type type = -1;
-      if (specifier == '%') {
-        type = TYPE_PERCENT;
-      } else if (specifier == 'p') {
-        type = TYPE_POINTER;
-      } else if (specifier == 'c') {
-        type = TYPE_INT;
-      } else if (specifier == 'b') {
-        type = TYPE_BOOL;
-      } else if (specifier == 's') {
-        type = TYPE_STRING;
-      } else if (specifier == 'n') {
-        // Reference
-        if (strcmp(length, "hh") == 0)
-          type = TYPE_POINTER_SIGNED_INT8;
-        else if (strcmp(length, "h") == 0)
-          type = TYPE_POINTER_SHORT;
-        else if (strcmp(length, "") == 0)
-          type = TYPE_POINTER_INT;
-        else if (strcmp(length, "l") == 0)
-          type = TYPE_POINTER_LONG;
-        else if (strcmp(length, "ll") == 0)
-          type = TYPE_POINTER_LONG_LONG;
-        else if (strcmp(length, "j") == 0)
-          type = TYPE_POINTER_INTMAX_T;
-        else if (strcmp(length, "z") == 0)
-          type = TYPE_POINTER_SSIZE_T;
-        else if (strcmp(length, "t") == 0)
-          type = TYPE_POINTER_PTRDIFF_T;
-        else
-          type = TYPE_POINTER_INT;
-      } else if (strchr("di", specifier)) {
-        // Signed integer
-        if (strcmp(length, "hh") == 0)
-          type = TYPE_SIGNED_INT8;
-        else if (strcmp(length, "h") == 0)
-          type = TYPE_SHORT;
-        else if (strcmp(length, "") == 0)
-          type = TYPE_INT;
-        else if (strcmp(length, "l") == 0)
-          type = TYPE_LONG;
-        else if (strcmp(length, "ll") == 0)
-          type = TYPE_LONG_LONG;
-        else if (strcmp(length, "j") == 0)
-          type = TYPE_INTMAX_T;
-        else if (strcmp(length, "z") == 0)
-          type = TYPE_SSIZE_T;
-        else if (strcmp(length, "t") == 0)
-          type = TYPE_PTRDIFF_T;
-        else
-          type = TYPE_INT;
-      } else if (strchr("ouxX", specifier)) {
-        // Unsigned integer
-        if (strcmp(length, "hh") == 0)
-          type = TYPE_UINT8;
-        else if (strcmp(length, "h") == 0)
-          type = TYPE_USHORT;
-        else if (strcmp(length, "") == 0)
-          type = TYPE_UINT;
-        else if (strcmp(length, "l") == 0)
-          type = TYPE_ULONG;
-        else if (strcmp(length, "ll") == 0)
-          type = TYPE_ULONG_LONG;
-        else if (strcmp(length, "j") == 0)
-          type = TYPE_UINTMAX_T;
-        else if (strcmp(length, "z") == 0)
-          type = TYPE_SIZE_T;
-        else if (strcmp(length, "t") == 0)
-          type = TYPE_PTRDIFF_T;
-        else
-          type = TYPE_UINT;
-      } else if (strchr("eEfFgGaA", specifier)) {
-        // Floating point
-        if (strcmp(length, "L") == 0)
-          type = TYPE_LONG_DOUBLE;
-        else
-          type = TYPE_DOUBLE;
-      } else
-        type = TYPE_NONE;
-
-      if (type != TYPE_NONE) {
-        count++;
-        specs.data =
-            (struct format_spec_t *)realloc(specs.data, count * sizeof(struct format_spec_t));
-        if (!specs.data) {
-          free(sub);
-          continue;
-        }
-        specs.data[count - 1].substr = sub;
-        specs.data[count - 1].type = type;
-        specs.count = count;
-      } else {
-        free(sub);
-      }
-    } else {
-      p++;
+typedef enum brace_type {
+  BRACE_DISPLAY,   // display_t*, formatted with its sndisplay_fn
+  BRACE_STRING,    // s: const char*
+  BRACE_HEX,       // x: const void*, size_t as lowercase hex digits
+  BRACE_HEX_UPPER, // X: the same in uppercase
+  BRACE_HEXDUMP,   // xd: const void*, size_t as the lines of `hexdump -C`
+  BRACE_BASE64,    // b64: const void*, size_t in base64 (RFC 4648 section 4)
+  BRACE_BASE64URL, // b64url: the same with the URL and filename safe alphabet (section 5)
+  BRACE_BINARY,    // b: unsigned int in binary
+  BRACE_BINARY_HH, // hhb: unsigned char, passed as unsigned int
+  BRACE_BINARY_H,  // hb: unsigned short, passed as unsigned int
+  BRACE_BINARY_L,  // lb: unsigned long
+  BRACE_BINARY_LL, // llb: unsigned long long
+  BRACE_BINARY_J,  // jb: uintmax_t
+  BRACE_BINARY_Z,  // zb: size_t
+} brace_type;
+
+#define BRACE_FLAG_MINUS 1u // '-': no '=' padding after base64
+#define BRACE_FLAG_ZERO 2u  // '0': binary padded with zeros to the width of its type
+#define BRACE_FLAG_GROUP 4u // '_': binary digits in groups of 4, separated by '_'
+
+typedef enum brace_filter {
+  BRACE_RAW,  // Unchanged
+  BRACE_JSON, // Inside a JSON string: \" \\ \n \r \t \b \f, other controls as \u00XX
+  BRACE_HTML, // HTML text or attribute value: &amp; &lt; &gt; &quot; &#39;
+  BRACE_URL,  // Percent-encoded, except the RFC 3986 unreserved A-Z a-z 0-9 - . _ ~
+  BRACE_SH,   // A single POSIX shell word in single quotes, ' as '\''
+  BRACE_C,    // Inside a C string literal: \" \\ \n \r \t \b \f, other bytes as \ooo
+} brace_filter;
+
+// A placeholder with options: `{:type}`, `{|filter}` or `{:type|filter}`, flags going before
+// the type
+typedef struct brace_spec_t {
+  size_t len; // Length of the placeholder in the format string
+  brace_type type;
+  brace_filter filter;
+  unsigned flags; // BRACE_FLAG_*
+
+} brace_spec_t;
+
+// The arguments taken by a brace placeholder
+typedef struct brace_arg_t {
+  const void *ptr;
+  size_t len;               // Of a buffer
+  unsigned long long value; // Of an integer
+
+} brace_arg_t;
+
+// Fetches the arguments of a brace placeholder. A macro, because a va_list parameter cannot be
+// passed on by address portably
+#define BRACE_ARG(spec, arg, args)                                                                \
+  do {                                                                                            \
+    (arg).ptr = NULL;                                                                             \
+    (arg).len = 0;                                                                                \
+    (arg).value = 0;                                                                              \
+    switch ((spec).type) {                                                                        \
+    case BRACE_DISPLAY:                                                                           \
+      (arg).ptr = va_arg(args, display_t *);                                                      \
+      break;                                                                                      \
+    case BRACE_STRING:                                                                            \
+      (arg).ptr = va_arg(args, const char *);                                                     \
+      break;                                                                                      \
+    case BRACE_BINARY:                                                                            \
+    case BRACE_BINARY_HH:                                                                         \
+    case BRACE_BINARY_H:                                                                          \
+      (arg).value = va_arg(args, unsigned int);                                                   \
+      break;                                                                                      \
+    case BRACE_BINARY_L:                                                                          \
+      (arg).value = va_arg(args, unsigned long);                                                  \
+      break;                                                                                      \
+    case BRACE_BINARY_LL:                                                                         \
+      (arg).value = va_arg(args, unsigned long long);                                             \
+      break;                                                                                      \
+    case BRACE_BINARY_J:                                                                          \
+      (arg).value = (unsigned long long)va_arg(args, uintmax_t);                                  \
+      break;                                                                                      \
+    case BRACE_BINARY_Z:                                                                          \
+      (arg).value = va_arg(args, size_t);                                                         \
+      break;                                                                                      \
+    default:                                                                                      \
+      (arg).ptr = va_arg(args, const void *);                                                     \
+      (arg).len = va_arg(args, size_t);                                                           \
+    }                                                                                             \
+  } while (0)
+
+/// @brief The width of an integer placeholder
+/// @return Its number of bits, or 0 if `type` takes no integer
+static int brace_bits(brace_type type) {
+  switch (type) {
+  case BRACE_BINARY:
+    return (int)sizeof(unsigned int) * 8;
+  case BRACE_BINARY_HH:
+    return 8;
+  case BRACE_BINARY_H:
+    return (int)sizeof(unsigned short) * 8;
+  case BRACE_BINARY_L:
+    return (int)sizeof(unsigned long) * 8;
+  case BRACE_BINARY_LL:
+    return (int)sizeof(unsigned long long) * 8;
+  case BRACE_BINARY_J:
+    return (int)sizeof(uintmax_t) * 8 > 64 ? 64 : (int)sizeof(uintmax_t) * 8;
+  case BRACE_BINARY_Z:
+    return (int)sizeof(size_t) * 8;
+  default:
+    return 0;
+  }
+}
+
+/// @brief Length of the run of ASCII letters and digits at `p`
+static size_t brace_name_len(const char *p) {
+  size_t n = 0;
+  while ((p[n] >= 'a' && p[n] <= 'z') || (p[n] >= 'A' && p[n] <= 'Z') ||
+         (p[n] >= '0' && p[n] <= '9'))
+    n++;
+  return n;
+}
+
+/// @brief Finds the `n` characters at `p` in `names`
+/// @return Their index, or -1 if they are not one of the names
+static int brace_lookup(const char *const *names, size_t count, const char *p, size_t n) {
+  for (size_t i = 0; i < count; i++)
+    if (strncmp(p, names[i], n) == 0 && names[i][n] == '\0')
+      return (int)i;
+  return -1;
+}
+
+/// @brief Parses the placeholder starting at `p`, which points at a '{' not followed by '}'
+/// @return 1 on success, 0 if `p` does not start a valid placeholder
+static int parse_brace_spec(const char *p, brace_spec_t *spec) {
+  static const char *const types[] = {"s",  "x",  "X",  "xd",  "b64", "b64url",
+                                      "b", "hhb", "hb", "lb", "llb", "jb", "zb"};
+  static const char *const filters[] = {"json", "html", "url", "sh", "c"};
+  const char *start = p;
+  p++; // Skip '{'
+
+  spec->type = BRACE_DISPLAY;
+  spec->filter = BRACE_RAW;
+  spec->flags = 0;
+  if (*p == ':') {
+    p++;
+    for (;; p++) {
+      unsigned flag = *p == '-'   ? BRACE_FLAG_MINUS
+                      : *p == '0' ? BRACE_FLAG_ZERO
+                      : *p == '_' ? BRACE_FLAG_GROUP
+                                  : 0;
+      if (!flag)
+        break;
+      spec->flags |= flag;
     }
+
+    size_t n = brace_name_len(p);
+    int i = brace_lookup(types, sizeof(types) / sizeof(types[0]), p, n);
+    if (i == -1)
+      return 0;
+
+    spec->type = (brace_type)(BRACE_STRING + i);
+    p += n;
+  }
+
+  unsigned allowed = 0;
+  if (spec->type == BRACE_BASE64 || spec->type == BRACE_BASE64URL)
+    allowed = BRACE_FLAG_MINUS;
+  else if (brace_bits(spec->type))
+    allowed = BRACE_FLAG_ZERO | BRACE_FLAG_GROUP;
+  if (spec->flags & ~allowed)
+    return 0;
+
+  if (*p == '|') {
+    p++;
+    size_t n = brace_name_len(p);
+    int i = brace_lookup(filters, sizeof(filters) / sizeof(filters[0]), p, n);
+    if (i == -1)
+      return 0;
+
+    spec->filter = (brace_filter)(BRACE_JSON + i);
+    p += n;
   }
 
-  return specs;
+  if (*p != '}')
+    return 0;
+
+  spec->len = (size_t)(p + 1 - start);
+  return 1;
 }
 
+static int brace_fprint(FILE *file, const char *format, const brace_spec_t *spec,
+                        const brace_arg_t *arg);
+static int brace_snprint(char *buf, size_t size, const char *format, const brace_spec_t *spec,
+                         const brace_arg_t *arg);
+
+// Set by display_stdout_bypass: display_print and display_println are written to it instead of
+// stdio
+static display_sink_t *stdout_sink = NULL;
+
+static int sink_vprint(display_sink_t *sink, int level, const char *format, va_list args,
+                       int newline, int elements);
+
 int display_vprint(const char *__restrict format, va_list args) {
   if (!format)
     return -1;
+  if (stdout_sink)
+    return sink_vprint(stdout_sink, DISPLAY_LEVEL_NONE, format, args, 0, 1);
 
+  DISPLAY_PROBE1(call_entry, format);
   int spec_count = 0, struct_count = 0;
-  format_specs_array_t specs = find_format_specifiers(format);
+  format_spec_t spec;
+  brace_spec_t brace;
   const char *p = format;
-  size_t spec_idx = 0;
 
   while (*p) {
     if (*p == '%' && *(p + 1) != '%') {
-      if (spec_idx < specs.count) {
-        switch (specs.data[spec_idx].type) {
+      if (parse_format_spec(p, &spec)) {
+        switch (spec.type) {
         // Signed integers
         case TYPE_INT:
-          printf(specs.data[spec_idx].substr, va_arg(args, int));
+          printf(spec.substr, va_arg(args, int));
           break;
         case TYPE_SIGNED_INT8:
-          printf(specs.data[spec_idx].substr, va_arg(args, int));
+          printf(spec.substr, va_arg(args, int));
           break;
         case TYPE_SHORT:
-          printf(specs.data[spec_idx].substr, va_arg(args, int));
+          printf(spec.substr, va_arg(args, int));
           break;
         case TYPE_LONG:
-          printf(specs.data[spec_idx].substr, va_arg(args, long));
+          printf(spec.substr, va_arg(args, long));
           break;
         case TYPE_LONG_LONG:
-          printf(specs.data[spec_idx].substr, va_arg(args, long long));
+          printf(spec.substr, va_arg(args, long long));
           break;
         case TYPE_INTMAX_T:
-          printf(specs.data[spec_idx].substr, va_arg(args, intmax_t));
+          printf(spec.substr, va_arg(args, intmax_t));
           break;
         case TYPE_SSIZE_T:
-          printf(specs.data[spec_idx].substr, va_arg(args, ssize_t));
+          printf(spec.substr, va_arg(args, ssize_t));
           break;
         case TYPE_PTRDIFF_T:
-          printf(specs.data[spec_idx].substr, va_arg(args, ptrdiff_t));
+          printf(spec.substr, va_arg(args, ptrdiff_t));
           break;
 
         // Unsigned integers
         case TYPE_UINT:
-          printf(specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          printf(spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_UINT8:
-          printf(specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          printf(spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_USHORT:
-          printf(specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          printf(spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_ULONG:
-          printf(specs.data[spec_idx].substr, va_arg(args, unsigned long));
+          printf(spec.substr, va_arg(args, unsigned long));
           break;
         case TYPE_ULONG_LONG:
-          printf(specs.data[spec_idx].substr, va_arg(args, unsigned long long));
+          printf(spec.substr, va_arg(args, unsigned long long));
           break;
         case TYPE_UINTMAX_T:
-          printf(specs.data[spec_idx].substr, va_arg(args, uintmax_t));
+          printf(spec.substr, va_arg(args, uintmax_t));
           break;
         case TYPE_SIZE_T:
-          printf(specs.data[spec_idx].substr, va_arg(args, size_t));
+          printf(spec.substr, va_arg(args, size_t));
           break;
 
         // Pointers
         case TYPE_POINTER:
-          printf(specs.data[spec_idx].substr, va_arg(args, void *));
+          printf(spec.substr, va_arg(args, void *));
           break;
         case TYPE_STRING:
-          printf(specs.data[spec_idx].substr, va_arg(args, char *));
+          printf(spec.substr, va_arg(args, char *));
           break;
 
         // Reference %n
@@ -479,13 +1021,13 @@ int display_vprint(const char *__restrict format, va_list args) {
 
         // Floating point
         case TYPE_FLOAT:
-          printf(specs.data[spec_idx].substr, va_arg(args, double));
+          printf(spec.substr, va_arg(args, double));
           break;
         case TYPE_DOUBLE:
-          printf(specs.data[spec_idx].substr, va_arg(args, double));
+          printf(spec.substr, va_arg(args, double));
           break;
         case TYPE_LONG_DOUBLE:
-          printf(specs.data[spec_idx].substr, va_arg(args, long double));
+          printf(spec.substr, va_arg(args, long double));
           break;
 
         case TYPE_BOOL:
@@ -496,8 +1038,7 @@ int display_vprint(const char *__restrict format, va_list args) {
         case TYPE_PERCENT:
           break;
         }
-        p += strlen(specs.data[spec_idx].substr);
-        spec_idx++;
+        p += spec.len;
         spec_count++;
       } else {
         putchar(*p);
@@ -513,25 +1054,36 @@ int display_vprint(const char *__restrict format, va_list args) {
         continue;
       }
 
-      if (d->display_fn(d->self) == -1) { // Error from display_fn
+      DISPLAY_PROBE2(callback_entry, format, d->self);
+      int written = d->display_fn(d->self);
+      DISPLAY_PROBE2(callback_exit, d->self, written);
+      if (written == -1) { // Error from display_fn
         p += 2;
         continue;
       }
 
       p += 2;
       struct_count++;
+    } else if (*p == '{' && parse_brace_spec(p, &brace)) {
+      brace_arg_t arg;
+      BRACE_ARG(brace, arg, args);
+      if (brace_fprint(stdout, format, &brace, &arg) == 1)
+        struct_count++;
+      p += brace.len;
     } else {
       putchar(*p);
       p++;
     }
   }
 
-  format_specs_array_t_free(&specs);
-
+  DISPLAY_PROBE2(call_exit, format, spec_count + struct_count);
   return spec_count + struct_count;
 }
 
 int display_vprintln(const char *__restrict format, va_list args) {
+  if (format && stdout_sink)
+    return sink_vprint(stdout_sink, DISPLAY_LEVEL_NONE, format, args, 1, 1);
+
   int result = display_vprint(format, args);
   if (result != -1)
     putchar('\n');
@@ -561,70 +1113,71 @@ int display_vfprint(FILE *file, const char *__restrict format, va_list args) {
   if (!format || !file)
     return -1;
 
+  DISPLAY_PROBE1(call_entry, format);
   int spec_count = 0, struct_count = 0;
-  format_specs_array_t specs = find_format_specifiers(format);
+  format_spec_t spec;
+  brace_spec_t brace;
   const char *p = format;
-  size_t spec_idx = 0;
 
   while (*p) {
     if (*p == '%' && *(p + 1) != '%') {
-      if (spec_idx < specs.count) {
-        switch (specs.data[spec_idx].type) {
+      if (parse_format_spec(p, &spec)) {
+        switch (spec.type) {
         // Signed integers
         case TYPE_INT:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, int));
+          fprintf(file, spec.substr, va_arg(args, int));
           break;
         case TYPE_SIGNED_INT8:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, int));
+          fprintf(file, spec.substr, va_arg(args, int));
           break;
         case TYPE_SHORT:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, int));
+          fprintf(file, spec.substr, va_arg(args, int));
           break;
         case TYPE_LONG:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, long));
+          fprintf(file, spec.substr, va_arg(args, long));
           break;
         case TYPE_LONG_LONG:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, long long));
+          fprintf(file, spec.substr, va_arg(args, long long));
           break;
         case TYPE_INTMAX_T:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, intmax_t));
+          fprintf(file, spec.substr, va_arg(args, intmax_t));
           break;
         case TYPE_SSIZE_T:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, ssize_t));
+          fprintf(file, spec.substr, va_arg(args, ssize_t));
           break;
         case TYPE_PTRDIFF_T:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, ptrdiff_t));
+          fprintf(file, spec.substr, va_arg(args, ptrdiff_t));
           break;
 
         // Unsigned integers
         case TYPE_UINT:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          fprintf(file, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_UINT8:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          fprintf(file, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_USHORT:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, unsigned int));
+          fprintf(file, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_ULONG:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, unsigned long));
+          fprintf(file, spec.substr, va_arg(args, unsigned long));
           break;
         case TYPE_ULONG_LONG:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, unsigned long long));
+          fprintf(file, spec.substr, va_arg(args, unsigned long long));
           break;
         case TYPE_UINTMAX_T:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, uintmax_t));
+          fprintf(file, spec.substr, va_arg(args, uintmax_t));
           break;
         case TYPE_SIZE_T:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, size_t));
+          fprintf(file, spec.substr, va_arg(args, size_t));
           break;
 
         // Pointers
         case TYPE_POINTER:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, void *));
+          fprintf(file, spec.substr, va_arg(args, void *));
           break;
         case TYPE_STRING:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, char *));
+          fprintf(file, spec.substr, va_arg(args, char *));
           break;
 
         // Reference %n
@@ -655,25 +1208,24 @@ int display_vfprint(FILE *file, const char *__restrict format, va_list args) {
 
         // Floating point
         case TYPE_FLOAT:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, double));
+          fprintf(file, spec.substr, va_arg(args, double));
           break;
         case TYPE_DOUBLE:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, double));
+          fprintf(file, spec.substr, va_arg(args, double));
           break;
         case TYPE_LONG_DOUBLE:
-          fprintf(file, specs.data[spec_idx].substr, va_arg(args, long double));
+          fprintf(file, spec.substr, va_arg(args, long double));
           break;
 
         case TYPE_BOOL:
-          printf(va_arg(args, int) ? "True" : "False");
+          fputs(va_arg(args, int) ? "True" : "False", file);
           break;
         case TYPE_NONE:
           break;
         case TYPE_PERCENT:
           break;
         }
-        p += strlen(specs.data[spec_idx].substr);
-        spec_idx++;
+        p += spec.len;
         spec_count++;
       } else {
         putc(*p, file);
@@ -689,21 +1241,29 @@ int display_vfprint(FILE *file, const char *__restrict format, va_list args) {
         continue;
       }
 
-      if (d->fdisplay_fn(d->self, file) == -1) { // Error from fdisplay_fn
+      DISPLAY_PROBE2(callback_entry, format, d->self);
+      int written = d->fdisplay_fn(d->self, file);
+      DISPLAY_PROBE2(callback_exit, d->self, written);
+      if (written == -1) { // Error from fdisplay_fn
         p += 2;
         continue;
       }
 
       p += 2;
       struct_count++;
+    } else if (*p == '{' && parse_brace_spec(p, &brace)) {
+      brace_arg_t arg;
+      BRACE_ARG(brace, arg, args);
+      if (brace_fprint(file, format, &brace, &arg) == 1)
+        struct_count++;
+      p += brace.len;
     } else {
       putc(*p, file);
       p++;
     }
   }
 
-  format_specs_array_t_free(&specs);
-
+  DISPLAY_PROBE2(call_exit, format, spec_count + struct_count);
   return spec_count + struct_count;
 }
 
@@ -739,9 +1299,10 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
   if (!buf && size > 0)
     return -1;
 
-  format_specs_array_t specs = find_format_specifiers(format);
+  DISPLAY_PROBE1(call_entry, format);
+  format_spec_t spec;
+  brace_spec_t brace;
   const char *p = format;
-  size_t spec_idx = 0;
 
   char *buf_ptr = buf;
   size_t remaining_size = size;
@@ -749,81 +1310,65 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
 
   while (*p) {
     if (*p == '%' && *(p + 1) != '%') {
-      if (spec_idx < specs.count) {
+      if (parse_format_spec(p, &spec)) {
         int written = 0;
-        switch (specs.data[spec_idx].type) {
+        switch (spec.type) {
         // Signed integers
         case TYPE_INT:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, int));
           break;
         case TYPE_SIGNED_INT8:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, int));
           break;
         case TYPE_SHORT:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, int));
           break;
         case TYPE_LONG:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, long));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, long));
           break;
         case TYPE_LONG_LONG:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, long long));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, long long));
           break;
         case TYPE_INTMAX_T:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, intmax_t));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, intmax_t));
           break;
         case TYPE_SSIZE_T:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, ssize_t));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, ssize_t));
           break;
         case TYPE_PTRDIFF_T:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, ptrdiff_t));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, ptrdiff_t));
           break;
 
         // Unsigned integers
         case TYPE_UINT:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, unsigned int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_UINT8:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, unsigned int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_USHORT:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, unsigned int));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, unsigned int));
           break;
         case TYPE_ULONG:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, unsigned long));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, unsigned long));
           break;
         case TYPE_ULONG_LONG:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
+          written = snprintf(buf_ptr, remaining_size, spec.substr,
                              va_arg(args, unsigned long long));
           break;
         case TYPE_UINTMAX_T:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, uintmax_t));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, uintmax_t));
           break;
         case TYPE_SIZE_T:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, size_t));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, size_t));
           break;
 
         // Pointers
         case TYPE_POINTER:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, void *));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, void *));
           break;
         case TYPE_STRING:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, char *));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, char *));
           break;
 
         // Reference %n
@@ -854,20 +1399,17 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
 
         // Floating point
         case TYPE_FLOAT:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, double));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, double));
           break;
         case TYPE_DOUBLE:
-          written =
-              snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr, va_arg(args, double));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, double));
           break;
         case TYPE_LONG_DOUBLE:
-          written = snprintf(buf_ptr, remaining_size, specs.data[spec_idx].substr,
-                             va_arg(args, long double));
+          written = snprintf(buf_ptr, remaining_size, spec.substr, va_arg(args, long double));
           break;
 
         case TYPE_BOOL:
-          printf(va_arg(args, int) ? "True" : "False");
+          written = snprintf(buf_ptr, remaining_size, "%s", va_arg(args, int) ? "True" : "False");
           break;
         case TYPE_NONE:
           break;
@@ -887,8 +1429,7 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
           total_chars += written;
         }
 
-        p += strlen(specs.data[spec_idx].substr);
-        spec_idx++;
+        p += spec.len;
       } else {
         if (remaining_size > 1) {
           *buf_ptr++ = *p;
@@ -911,7 +1452,9 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
         continue;
       }
 
+      DISPLAY_PROBE2(callback_entry, format, d->self);
       int written = d->sndisplay_fn(d->self, buf_ptr, remaining_size);
+      DISPLAY_PROBE2(callback_exit, d->self, written);
       if (written >= 0) {
         if ((size_t)written < remaining_size) {
           buf_ptr += written;
@@ -925,6 +1468,23 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
       }
 
       p += 2;
+    } else if (*p == '{' && parse_brace_spec(p, &brace)) {
+      brace_arg_t arg;
+      BRACE_ARG(brace, arg, args);
+      int written = brace_snprint(buf_ptr, remaining_size, format, &brace, &arg);
+      if (written >= 0) {
+        if ((size_t)written < remaining_size) {
+          buf_ptr += written;
+          remaining_size -= written;
+        } else {
+          if (remaining_size > 0)
+            buf_ptr += remaining_size - 1;
+          remaining_size = (remaining_size > 0) ? 1 : 0;
+        }
+        total_chars += written;
+      }
+
+      p += brace.len;
     } else {
       if (remaining_size > 1) {
         *buf_ptr++ = *p;
@@ -939,8 +1499,7 @@ int display_vsnprint(char *buf, size_t size, const char *__restrict format, va_l
     *buf_ptr = '\0';
   }
 
-  format_specs_array_t_free(&specs);
-
+  DISPLAY_PROBE2(call_exit, format, total_chars);
   return total_chars;
 }
 
@@ -975,6 +1534,3833 @@ int display_snprintln(char *buf, size_t size, const char *__restrict format, ...
   return result;
 }
 
+static uint32_t load_le32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store_le32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)v;
+  p[1] = (uint8_t)(v >> 8);
+  p[2] = (uint8_t)(v >> 16);
+  p[3] = (uint8_t)(v >> 24);
+}
+
+static uint64_t load_le64(const uint8_t *p) {
+  return (uint64_t)load_le32(p) | (uint64_t)load_le32(p + 4) << 32;
+}
+
+static void store_le64(uint8_t *p, uint64_t v) {
+  store_le32(p, (uint32_t)v);
+  store_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+#ifndef DISPLAY_STAGE_INLINE
+#define DISPLAY_STAGE_INLINE 1024 // Records up to this size are formatted without allocating
+#endif
+
+// A record being formatted for a sink: starts in the inline buffer, moves to the heap if it grows
+typedef struct format_stage_t {
+  char *data;
+  size_t len, cap;
+  char inline_buf[DISPLAY_STAGE_INLINE];
+
+} format_stage_t;
+
+/// @brief Makes room for `n` more bytes and a terminating '\0'
+/// @return 0 on success, -1 on failure
+static int stage_reserve(format_stage_t *st, size_t n) {
+  if (st->len + n < st->cap)
+    return 0;
+
+  size_t cap = st->cap * 2;
+  if (cap < st->len + n + 1)
+    cap = st->len + n + 1;
+
+  char *data;
+  if (st->data == st->inline_buf) {
+    data = (char *)malloc(cap);
+    if (data)
+      memcpy(data, st->data, st->len);
+  } else {
+    data = (char *)realloc(st->data, cap);
+  }
+  if (!data)
+    return -1;
+
+  st->data = data;
+  st->cap = cap;
+  return 0;
+}
+
+static int stage_append(format_stage_t *st, const char *data, size_t len) {
+  if (stage_reserve(st, len) == -1)
+    return -1;
+
+  memcpy(st->data + st->len, data, len);
+  st->len += len;
+  return (int)len;
+}
+
+/// @brief snprintf at the end of the stage, growing it when the output does not fit
+/// @return The number of characters appended or -1 on failure
+static int stage_printf(format_stage_t *st, const char *spec, ...) {
+  va_list args, retry;
+  va_start(args, spec);
+  va_copy(retry, args);
+  int written = vsnprintf(st->data + st->len, st->cap - st->len, spec, args);
+  va_end(args);
+
+  if (written >= 0 && (size_t)written >= st->cap - st->len) {
+    if (stage_reserve(st, (size_t)written) == -1)
+      written = -1;
+    else
+      vsnprintf(st->data + st->len, st->cap - st->len, spec, retry);
+  }
+  va_end(retry);
+
+  if (written > 0)
+    st->len += written;
+  return written;
+}
+
+static void stage_init(format_stage_t *st) {
+  st->data = st->inline_buf;
+  st->len = 0;
+  st->cap = sizeof(st->inline_buf);
+}
+
+static void stage_release(format_stage_t *st) {
+  if (st->data != st->inline_buf)
+    free(st->data);
+}
+
+/// @brief Tells whether `filter` rewrites the byte `c`
+static int escape_needed(brace_filter filter, unsigned char c) {
+  switch (filter) {
+  case BRACE_JSON:
+    return c < 0x20 || c == '"' || c == '\\';
+  case BRACE_HTML:
+    return c == '&' || c == '<' || c == '>' || c == '"' || c == '\'';
+  case BRACE_URL:
+    return !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+             c == '-' || c == '.' || c == '_' || c == '~');
+  case BRACE_SH:
+    return c == '\'';
+  case BRACE_C:
+    return c < 0x20 || c >= 0x7f || c == '"' || c == '\\';
+  default:
+    return 0;
+  }
+}
+
+#ifdef DISPLAY_ESCAPE_SSE2
+/// @brief escape_needed for 16 bytes at once
+/// @return A mask with bit i set if byte i of `v` is rewritten
+static unsigned escape_mask(brace_filter filter, __m128i v) {
+  __m128i m;
+  switch (filter) {
+  case BRACE_JSON:
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v)); // v <= 0x1f
+    break;
+  case BRACE_HTML:
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('&')), _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\'')));
+    break;
+  case BRACE_URL: {
+    // Bytes >= 0x80 are negative, so the signed range checks leave them out
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    m = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+    m = _mm_or_si128(m, _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('-')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('~')));
+    return ~(unsigned)_mm_movemask_epi8(m) & 0xffff;
+  }
+  case BRACE_SH:
+    m = _mm_cmpeq_epi8(v, _mm_set1_epi8('\''));
+    break;
+  case BRACE_C:
+    m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x7f)), v)); // v >= 0x7f
+    break;
+  default:
+    return 0;
+  }
+  return (unsigned)_mm_movemask_epi8(m);
+}
+#endif
+
+/// @brief Length of the prefix of `data` that `filter` leaves unchanged
+static size_t escape_clean_run(brace_filter filter, const char *data, size_t len) {
+  size_t i = 0;
+#ifdef DISPLAY_ESCAPE_SSE2
+  for (; i + 16 <= len; i += 16) {
+    unsigned mask = escape_mask(filter, _mm_loadu_si128((const __m128i *)(data + i)));
+    if (mask)
+      return i + (size_t)__builtin_ctz(mask);
+  }
+#endif
+  while (i < len && !escape_needed(filter, (unsigned char)data[i]))
+    i++;
+  return i;
+}
+
+/// @brief Writes what `filter` replaces the byte `c` with to `out`, which has room for 8 bytes
+/// @return Its length
+static size_t escape_byte(brace_filter filter, unsigned char c, char *out) {
+  static const char lower[] = "0123456789abcdef", upper[] = "0123456789ABCDEF";
+  static const char from[] = "\"\\\n\r\t\b\f", to[] = "\"\\nrtbf";
+  const char *named = c ? strchr(from, c) : NULL;
+
+  switch (filter) {
+  case BRACE_JSON:
+  case BRACE_C:
+    out[0] = '\\';
+    if (named) {
+      out[1] = to[named - from];
+      return 2;
+    }
+    if (filter == BRACE_JSON) {
+      memcpy(out + 1, "u00", 3);
+      out[4] = lower[c >> 4];
+      out[5] = lower[c & 15];
+      return 6;
+    }
+    // Octal always takes 3 digits, so a digit after it cannot extend the escape
+    out[1] = (char)('0' + (c >> 6));
+    out[2] = (char)('0' + (c >> 3 & 7));
+    out[3] = (char)('0' + (c & 7));
+    return 4;
+  case BRACE_HTML: {
+    const char *entity = c == '&'   ? "&amp;"
+                         : c == '<' ? "&lt;"
+                         : c == '>' ? "&gt;"
+                         : c == '"' ? "&quot;"
+                                    : "&#39;";
+    size_t n = strlen(entity);
+    memcpy(out, entity, n);
+    return n;
+  }
+  case BRACE_URL:
+    out[0] = '%';
+    out[1] = upper[c >> 4];
+    out[2] = upper[c & 15];
+    return 3;
+  case BRACE_SH:
+    memcpy(out, "'\\''", 4);
+    return 4;
+  default:
+    out[0] = (char)c;
+    return 1;
+  }
+}
+
+/// @brief Appends `data` to the stage through `filter`, copying the runs it leaves unchanged as
+///        they are
+/// @return 0 on success, -1 on failure
+static int escape_append(format_stage_t *st, brace_filter filter, const char *data, size_t len) {
+  if (filter == BRACE_RAW)
+    return stage_append(st, data, len) == -1 ? -1 : 0;
+  if (stage_reserve(st, len + 2) == -1 || (filter == BRACE_SH && stage_append(st, "'", 1) == -1))
+    return -1;
+
+  size_t i = 0;
+  while (i < len) {
+    size_t run = escape_clean_run(filter, data + i, len - i);
+    if (run > 0 && stage_append(st, data + i, run) == -1)
+      return -1;
+    i += run;
+    if (i == len)
+      break;
+
+    char escaped[8];
+    if (stage_append(st, escaped, escape_byte(filter, (unsigned char)data[i], escaped)) == -1)
+      return -1;
+    i++;
+  }
+
+  return filter == BRACE_SH && stage_append(st, "'", 1) == -1 ? -1 : 0;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DISPLAY_HEX_SIMD 1
+#include <immintrin.h>
+
+// Each nibble indexes the 16 digits with pshufb, and the digits of the high and low nibbles are
+// interleaved into pairs
+__attribute__((target("ssse3"))) static size_t hex_encode_ssse3(char *out, const uint8_t *p,
+                                                                size_t len, const char *digits) {
+  __m128i table = _mm_loadu_si128((const __m128i *)digits), nibble = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i hi = _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    __m128i lo = _mm_shuffle_epi8(table, _mm_and_si128(v, nibble));
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) static size_t hex_encode_avx2(char *out, const uint8_t *p,
+                                                              size_t len, const char *digits) {
+  __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)digits));
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble));
+    // Unpacking works within 128-bit lanes: a holds bytes 0-7 and 16-23, b bytes 8-15 and 24-31
+    __m256i a = _mm256_unpacklo_epi8(hi, lo), b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256((__m256i *)(out + 2 * i), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256((__m256i *)(out + 2 * i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  return i;
+}
+#endif
+
+/// @brief Writes the `2 * len` hex digits of the bytes at `p` to `out`
+static void hex_encode(char *out, const uint8_t *p, size_t len, int upper) {
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  size_t i = 0;
+#ifdef DISPLAY_HEX_SIMD
+  if (len >= 32 && __builtin_cpu_supports("avx2"))
+    i = hex_encode_avx2(out, p, len, digits);
+  if (len - i >= 16 && __builtin_cpu_supports("ssse3"))
+    i += hex_encode_ssse3(out + 2 * i, p + i, len - i, digits);
+#endif
+  for (; i < len; i++) {
+    out[2 * i] = digits[p[i] >> 4];
+    out[2 * i + 1] = digits[p[i] & 15];
+  }
+}
+
+/// @brief Writes `offset` as `hexdump -C` does, in at least 8 lowercase hex digits
+/// @return Its length
+static size_t hexdump_offset(char *out, uint64_t offset) {
+  static const char digits[] = "0123456789abcdef";
+  int n = 8;
+  while (n < 16 && offset >> (4 * n))
+    n++;
+  for (int i = 0; i < n; i++)
+    out[i] = digits[offset >> (4 * (n - 1 - i)) & 15];
+  return (size_t)n;
+}
+
+#define HEXDUMP_LINE_MAX 96 // Longest line with a 16-digit offset, and its newline
+
+/// @brief Writes the `hexdump -C` line of `n` bytes, 1 to 16, at `p` to `out`
+/// @return Its length, without a newline
+static size_t hexdump_line(char *out, const uint8_t *p, size_t n, uint64_t offset) {
+  char hex[32];
+  size_t len = hexdump_offset(out, offset);
+  hex_encode(hex, p, n, 0);
+
+  // Two spaces, 8 times "xx ", a space, 8 times "xx " and a space, padded when the line is short
+  memset(out + len, ' ', 52);
+  for (size_t i = 0; i < n; i++)
+    memcpy(out + len + 2 + 3 * i + (i >= 8), hex + 2 * i, 2);
+  len += 52;
+
+  out[len++] = '|';
+#ifdef DISPLAY_ESCAPE_SSE2
+  if (n == 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+    v = _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, _mm_set1_epi8('.')));
+    _mm_storeu_si128((__m128i *)(out + len), v);
+    n = 0;
+    len += 16;
+  }
+#endif
+  for (size_t i = 0; i < n; i++)
+    out[len++] = p[i] >= 0x20 && p[i] < 0x7f ? (char)p[i] : '.';
+  out[len++] = '|';
+  return len;
+}
+
+/// @brief Appends the hex digits of a buffer to the stage
+/// @return 0 on success, -1 on failure
+static int hex_append(format_stage_t *st, const uint8_t *p, size_t len, int upper) {
+  if (len > SIZE_MAX / 2 || stage_reserve(st, 2 * len) == -1)
+    return -1;
+
+  hex_encode(st->data + st->len, p, len, upper);
+  st->len += 2 * len;
+  return 0;
+}
+
+/// @brief Appends a buffer to the stage as `hexdump -C` prints it: lines of 16 bytes, then the
+///        length as a last offset, without a final newline
+/// @return 0 on success, -1 on failure
+static int hexdump_append(format_stage_t *st, const uint8_t *p, size_t len) {
+  size_t lines = len / 16 + 1;
+  if (lines > SIZE_MAX / HEXDUMP_LINE_MAX || stage_reserve(st, lines * HEXDUMP_LINE_MAX) == -1)
+    return -1;
+
+  char *out = st->data + st->len;
+  for (size_t i = 0; i < len; i += 16) {
+    out += hexdump_line(out, p + i, len - i < 16 ? len - i : 16, i);
+    *out++ = '\n';
+  }
+  out += hexdump_offset(out, len);
+
+  st->len = (size_t)(out - st->data);
+  return 0;
+}
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char base64url_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+#ifdef DISPLAY_HEX_SIMD
+// The base64 kernels of Wojciech Mula: each 32-bit lane gets 3 input bytes, whose four 6-bit
+// fields are moved to the low bits of four bytes with two multiplies, then every field is turned
+// into its digit by adding an offset chosen by its range with pshufb. The alphabets only differ
+// in `c62` and `c63`, the digits for 62 and 63
+__attribute__((target("ssse3"))) static __m128i base64_digits_ssse3(__m128i in, char c62,
+                                                                   char c63) {
+  in = _mm_shuffle_epi8(in, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+                               _mm_set1_epi32(0x04000040));
+  __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+                               _mm_set1_epi32(0x01000010));
+  __m128i fields = _mm_or_si128(hi, lo);
+
+  // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+  __m128i range = _mm_subs_epu8(fields, _mm_set1_epi8(51));
+  range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), fields),
+                                            _mm_set1_epi8(13)));
+  __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                  '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                  (char)(c62 - 62), (char)(c63 - 63), 'A', 0, 0);
+  return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), fields);
+}
+
+/// @return The number of bytes encoded, a multiple of 12
+__attribute__((target("ssse3"))) static size_t base64_encode_ssse3(char *out, const uint8_t *p,
+                                                                   size_t len, const char *digits) {
+  size_t i = 0;
+  for (; i + 16 <= len; i += 12, out += 16) // Loads 16 bytes to use 12
+    _mm_storeu_si128((__m128i *)out, base64_digits_ssse3(_mm_loadu_si128((const __m128i *)(p + i)),
+                                                         digits[62], digits[63]));
+  return i;
+}
+
+/// @return The number of bytes encoded, a multiple of 24
+__attribute__((target("avx2"))) static size_t base64_encode_avx2(char *out, const uint8_t *p,
+                                                                 size_t len, const char *digits) {
+  const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0,
+                                           2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i offsets = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, (char)(digits[62] - 62), (char)(digits[63] - 63), 'A', 0, 0, 'a' - 26,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, (char)(digits[62] - 62), (char)(digits[63] - 63), 'A', 0, 0);
+  size_t i = 0;
+  for (; i + 28 <= len; i += 24, out += 32) { // Each lane loads 16 bytes to use 12
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + i))),
+        _mm_loadu_si128((const __m128i *)(p + i + 12)), 1);
+    in = _mm256_shuffle_epi8(in, shuffle);
+    __m256i hi = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+                                    _mm256_set1_epi32(0x04000040));
+    __m256i lo = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+                                    _mm256_set1_epi32(0x01000010));
+    __m256i fields = _mm256_or_si256(hi, lo);
+
+    __m256i range = _mm256_subs_epu8(fields, _mm256_set1_epi8(51));
+    range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), fields),
+                                                    _mm256_set1_epi8(13)));
+    _mm256_storeu_si256((__m256i *)out,
+                        _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), fields));
+  }
+  return i;
+}
+#endif
+
+/// @brief Appends a buffer to the stage in base64
+/// @param digits  base64_digits or base64url_digits
+/// @return 0 on success, -1 on failure
+static int base64_append(format_stage_t *st, const uint8_t *p, size_t len, const char *digits,
+                         int pad) {
+  if (len / 3 > SIZE_MAX / 4 - 1 || stage_reserve(st, (len / 3 + 1) * 4) == -1)
+    return -1;
+
+  char *out = st->data + st->len;
+  size_t i = 0;
+#ifdef DISPLAY_HEX_SIMD
+  if (len >= 28 && __builtin_cpu_supports("avx2")) {
+    i = base64_encode_avx2(out, p, len, digits);
+    out += i / 3 * 4;
+  }
+  if (len - i >= 16 && __builtin_cpu_supports("ssse3")) {
+    size_t n = base64_encode_ssse3(out, p + i, len - i, digits);
+    out += n / 3 * 4;
+    i += n;
+  }
+#endif
+  for (; i + 3 <= len; i += 3, out += 4) {
+    uint32_t v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+    out[0] = digits[v >> 18];
+    out[1] = digits[v >> 12 & 63];
+    out[2] = digits[v >> 6 & 63];
+    out[3] = digits[v & 63];
+  }
+
+  if (i < len) { // 1 or 2 bytes left: 2 or 3 digits
+    uint32_t v = (uint32_t)p[i] << 16 | (i + 1 < len ? (uint32_t)p[i + 1] << 8 : 0);
+    *out++ = digits[v >> 18];
+    *out++ = digits[v >> 12 & 63];
+    if (i + 1 < len)
+      *out++ = digits[v >> 6 & 63];
+    else if (pad)
+      *out++ = '=';
+    if (pad)
+      *out++ = '=';
+  }
+
+  st->len = (size_t)(out - st->data);
+  return 0;
+}
+
+/// @brief Writes the 8 bits of `byte` to `out` as '0' and '1', the most significant first
+static void binary_byte(char *out, unsigned byte) {
+  // The multiply copies the byte into every byte of the product, each copy shifted so that a
+  // different bit lands on its top bit: byte i of the result is bit 7 - i, as 0 or 1
+  uint64_t bits = ((uint64_t)byte * 0x8040201008040201ull & 0x8080808080808080ull) >> 7;
+  store_le64((uint8_t *)out, bits | 0x3030303030303030ull); // '0' is 0x30
+}
+
+/// @brief Appends the `bits` low bits of `value` to the stage in binary: without leading zeros,
+///        or all of them with BRACE_FLAG_ZERO, in groups of 4 with BRACE_FLAG_GROUP
+/// @return 0 on success, -1 on failure
+static int binary_append(format_stage_t *st, unsigned long long value, int bits,
+                         unsigned flags) {
+  if (bits < 64)
+    value &= (1ull << bits) - 1;
+
+  int digits = bits;
+  if (!(flags & BRACE_FLAG_ZERO))
+    while (digits > 1 && !(value >> (digits - 1)))
+      digits--;
+
+  // Whole bytes of digits, 8 at a time, of which the last `digits` are kept
+  char buf[64];
+  int bytes = (digits + 7) / 8;
+  for (int i = 0; i < bytes; i++)
+    binary_byte(buf + 8 * i, (unsigned)(value >> (8 * (bytes - 1 - i))) & 0xff);
+  const char *first = buf + 8 * bytes - digits;
+
+  if (!(flags & BRACE_FLAG_GROUP))
+    return stage_append(st, first, (size_t)digits) == -1 ? -1 : 0;
+
+  if (stage_reserve(st, (size_t)(digits + digits / 4)) == -1)
+    return -1;
+  char *out = st->data + st->len;
+  int head = digits % 4 ? digits % 4 : 4;
+  for (int i = 0; i < head; i++)
+    *out++ = first[i];
+  for (int i = head; i < digits; i += 4) {
+    *out++ = '_';
+    memcpy(out, first + i, 4);
+    out += 4;
+  }
+
+  st->len = (size_t)(out - st->data);
+  return 0;
+}
+
+/// @brief Formats the value of a brace placeholder, unfiltered, at the end of the stage
+/// @return 1 on success, 0 if the argument is skipped (a struct without sndisplay_fn), -1 on
+///         failure
+static int brace_render(format_stage_t *st, const char *format, const brace_spec_t *spec,
+                        const brace_arg_t *arg) {
+  const uint8_t *bytes = (const uint8_t *)arg->ptr;
+  switch (spec->type) {
+  case BRACE_STRING:
+    return stage_append(st, (const char *)bytes, strlen((const char *)bytes)) == -1 ? -1 : 1;
+  case BRACE_HEX:
+  case BRACE_HEX_UPPER:
+    return hex_append(st, bytes, arg->len, spec->type == BRACE_HEX_UPPER) == -1 ? -1 : 1;
+  case BRACE_HEXDUMP:
+    return hexdump_append(st, bytes, arg->len) == -1 ? -1 : 1;
+  case BRACE_BASE64:
+  case BRACE_BASE64URL:
+    return base64_append(st, bytes, arg->len,
+                         spec->type == BRACE_BASE64 ? base64_digits : base64url_digits,
+                         !(spec->flags & BRACE_FLAG_MINUS)) == -1
+               ? -1
+               : 1;
+  case BRACE_BINARY:
+  case BRACE_BINARY_HH:
+  case BRACE_BINARY_H:
+  case BRACE_BINARY_L:
+  case BRACE_BINARY_LL:
+  case BRACE_BINARY_J:
+  case BRACE_BINARY_Z:
+    return binary_append(st, arg->value, brace_bits(spec->type), spec->flags) == -1 ? -1 : 1;
+  case BRACE_DISPLAY:
+    break;
+  }
+
+  const display_t *d = (const display_t *)arg->ptr;
+  if (!d->self || !d->sndisplay_fn)
+    return 0;
+
+  (void)format; // Only used by the probes
+  int failed = 0;
+  DISPLAY_PROBE2(callback_entry, format, d->self);
+  int result = d->sndisplay_fn(d->self, st->data + st->len, st->cap - st->len);
+  if (result >= 0 && (size_t)result >= st->cap - st->len) {
+    if (stage_reserve(st, (size_t)result) == -1)
+      failed = 1;
+    else
+      result = d->sndisplay_fn(d->self, st->data + st->len, st->cap - st->len);
+  }
+  DISPLAY_PROBE2(callback_exit, d->self, result);
+
+  if (failed || result < 0)
+    return failed ? -1 : 0;
+  st->len += (size_t)result;
+  return 1;
+}
+
+/// @brief Formats a brace placeholder at the end of the stage
+/// @return 1 on success, 0 if the argument is skipped (NULL, or a struct without sndisplay_fn),
+///         -1 on failure
+static int brace_to_stage(format_stage_t *st, const char *format, const brace_spec_t *spec,
+                          const brace_arg_t *arg) {
+  if (!arg->ptr && !brace_bits(spec->type))
+    return 0;
+  if (spec->type == BRACE_STRING) {
+    const char *str = (const char *)arg->ptr;
+    return escape_append(st, spec->filter, str, strlen(str)) == -1 ? -1 : 1;
+  }
+  if (spec->filter == BRACE_RAW)
+    return brace_render(st, format, spec, arg);
+
+  // Anything else is formatted into a stage of its own, which is then filtered into the record
+  format_stage_t raw;
+  stage_init(&raw);
+  int result = brace_render(&raw, format, spec, arg);
+  if (result == 1 && escape_append(st, spec->filter, raw.data, raw.len) == -1)
+    result = -1;
+
+  stage_release(&raw);
+  return result;
+}
+
+/// @brief Formats a brace placeholder and writes it to `file`
+/// @return 1 on success, 0 if the argument is skipped, -1 on failure
+static int brace_fprint(FILE *file, const char *format, const brace_spec_t *spec,
+                        const brace_arg_t *arg) {
+  format_stage_t st;
+  stage_init(&st);
+  int result = brace_to_stage(&st, format, spec, arg);
+  if (result == 1 && fwrite(st.data, 1, st.len, file) != st.len)
+    result = -1;
+
+  stage_release(&st);
+  return result;
+}
+
+/// @brief Formats a brace placeholder into `buf` like snprintf, without the terminating '\0'
+/// @return The length of the whole output, of which at most `size - 1` bytes are stored, or -1
+///         if there is none
+static int brace_snprint(char *buf, size_t size, const char *format, const brace_spec_t *spec,
+                         const brace_arg_t *arg) {
+  format_stage_t st;
+  stage_init(&st);
+  int result = brace_to_stage(&st, format, spec, arg) == 1 ? (int)st.len : -1;
+  if (result > 0 && size > 0)
+    memcpy(buf, st.data, st.len < size ? st.len : size - 1);
+
+  stage_release(&st);
+  return result;
+}
+
+/// @brief Formats one record into the stage
+/// @param fallback  The stdout sink when called for display_print: `{}` arguments that only have
+///                  a display_fn are printed through stdio after writing what was staged so far,
+///                  and %n stores the number of elements instead of characters
+/// @return The number of elements (valid conversions and structs printed) or -1 on failure
+static int format_to_stage(format_stage_t *st, const char *format, va_list args,
+                           display_sink_t *fallback) {
+  int elements = 0, written = 0;
+  format_spec_t spec;
+  brace_spec_t brace;
+  const char *p = format;
+
+  while (*p && written != -1) {
+    if (*p == '%' && *(p + 1) != '%') {
+      if (parse_format_spec(p, &spec)) {
+        long long n = fallback ? elements : (long long)st->len;
+        switch (spec.type) {
+        // Signed integers
+        case TYPE_INT:
+        case TYPE_SIGNED_INT8:
+        case TYPE_SHORT:
+          written = stage_printf(st, spec.substr, va_arg(args, int));
+          break;
+        case TYPE_LONG:
+          written = stage_printf(st, spec.substr, va_arg(args, long));
+          break;
+        case TYPE_LONG_LONG:
+          written = stage_printf(st, spec.substr, va_arg(args, long long));
+          break;
+        case TYPE_INTMAX_T:
+          written = stage_printf(st, spec.substr, va_arg(args, intmax_t));
+          break;
+        case TYPE_SSIZE_T:
+          written = stage_printf(st, spec.substr, va_arg(args, ssize_t));
+          break;
+        case TYPE_PTRDIFF_T:
+          written = stage_printf(st, spec.substr, va_arg(args, ptrdiff_t));
+          break;
+
+        // Unsigned integers
+        case TYPE_UINT:
+        case TYPE_UINT8:
+        case TYPE_USHORT:
+          written = stage_printf(st, spec.substr, va_arg(args, unsigned int));
+          break;
+        case TYPE_ULONG:
+          written = stage_printf(st, spec.substr, va_arg(args, unsigned long));
+          break;
+        case TYPE_ULONG_LONG:
+          written = stage_printf(st, spec.substr, va_arg(args, unsigned long long));
+          break;
+        case TYPE_UINTMAX_T:
+          written = stage_printf(st, spec.substr, va_arg(args, uintmax_t));
+          break;
+        case TYPE_SIZE_T:
+          written = stage_printf(st, spec.substr, va_arg(args, size_t));
+          break;
+
+        // Pointers
+        case TYPE_POINTER:
+          written = stage_printf(st, spec.substr, va_arg(args, void *));
+          break;
+        case TYPE_STRING:
+          written = stage_printf(st, spec.substr, va_arg(args, char *));
+          break;
+
+        // Reference %n
+        case TYPE_POINTER_INT:
+          *va_arg(args, int *) = (int)n;
+          break;
+        case TYPE_POINTER_SIGNED_INT8:
+          *va_arg(args, signed char *) = (signed char)n;
+          break;
+        case TYPE_POINTER_SHORT:
+          *va_arg(args, short *) = (short)n;
+          break;
+        case TYPE_POINTER_LONG:
+          *va_arg(args, long *) = (long)n;
+          break;
+        case TYPE_POINTER_LONG_LONG:
+          *va_arg(args, long long *) = n;
+          break;
+        case TYPE_POINTER_INTMAX_T:
+          *va_arg(args, intmax_t *) = n;
+          break;
+        case TYPE_POINTER_SSIZE_T:
+          *va_arg(args, ssize_t *) = (ssize_t)n;
+          break;
+        case TYPE_POINTER_PTRDIFF_T:
+          *va_arg(args, ptrdiff_t *) = (ptrdiff_t)n;
+          break;
+
+        // Floating point
+        case TYPE_FLOAT:
+        case TYPE_DOUBLE:
+          written = stage_printf(st, spec.substr, va_arg(args, double));
+          break;
+        case TYPE_LONG_DOUBLE:
+          written = stage_printf(st, spec.substr, va_arg(args, long double));
+          break;
+
+        case TYPE_BOOL:
+          written = va_arg(args, int) ? stage_append(st, "True", 4) : stage_append(st, "False", 5);
+          break;
+        case TYPE_NONE:
+          break;
+        case TYPE_PERCENT:
+          break;
+        }
+        p += spec.len;
+        elements++;
+      } else {
+        written = stage_append(st, p, 1);
+        p++;
+      }
+    } else if (*p == '%' && *(p + 1) == '%') {
+      written = stage_append(st, "%", 1);
+      p += 2;
+    } else if (*p == '{' && *(p + 1) == '}') {
+      display_t *d = va_arg(args, display_t *);
+      p += 2;
+      if (!d || !d->self) // Invalid pointer
+        continue;
+
+      int result = -1;
+      if (d->sndisplay_fn) {
+        DISPLAY_PROBE2(callback_entry, format, d->self);
+        result = d->sndisplay_fn(d->self, st->data + st->len, st->cap - st->len);
+        if (result >= 0 && (size_t)result >= st->cap - st->len) {
+          if (stage_reserve(st, (size_t)result) == -1)
+            written = -1;
+          else
+            result = d->sndisplay_fn(d->self, st->data + st->len, st->cap - st->len);
+        }
+        DISPLAY_PROBE2(callback_exit, d->self, result);
+        if (result > 0 && written != -1)
+          st->len += result;
+      } else if (fallback && d->display_fn) {
+        // No way to format it into the record: keep the order by writing what is staged first
+        if (st->len > 0 &&
+            fallback->write_fn(fallback->self, DISPLAY_LEVEL_NONE, st->data, st->len) == -1)
+          written = -1;
+        st->len = 0;
+        if (fallback->flush_fn)
+          fallback->flush_fn(fallback->self);
+
+        DISPLAY_PROBE2(callback_entry, format, d->self);
+        result = d->display_fn(d->self);
+        DISPLAY_PROBE2(callback_exit, d->self, result);
+        fflush(stdout);
+      }
+
+      if (result >= 0)
+        elements++;
+    } else if (*p == '{' && parse_brace_spec(p, &brace)) {
+      brace_arg_t arg;
+      BRACE_ARG(brace, arg, args);
+      p += brace.len;
+
+      int result = brace_to_stage(st, format, &brace, &arg);
+      if (result == -1)
+        written = -1;
+      else
+        elements += result;
+    } else {
+      // Copy the whole run of plain text at once
+      size_t run = strcspn(p, "%{");
+      if (run == 0)
+        run = 1;
+      written = stage_append(st, p, run);
+      p += run;
+    }
+  }
+
+  return written == -1 ? -1 : elements;
+}
+
+/// @brief Formats one record and hands it to the sink with a single write_fn call
+/// @return The number of elements if `elements` is set, of characters otherwise, or -1 on failure
+static int sink_vprint(display_sink_t *sink, int level, const char *format, va_list args,
+                       int newline, int elements) {
+  DISPLAY_PROBE1(call_entry, format);
+  format_stage_t st;
+  stage_init(&st);
+
+  int result = format_to_stage(&st, format, args, elements ? sink : NULL);
+  if (result != -1 && newline)
+    result = stage_append(&st, "\n", 1) == -1 ? -1 : result;
+  if (result != -1 && st.len > 0 && sink->write_fn(sink->self, level, st.data, st.len) == -1)
+    result = -1;
+  if (result != -1 && !elements)
+    result = (int)st.len;
+
+  stage_release(&st);
+
+  DISPLAY_PROBE2(call_exit, format, result);
+  return result;
+}
+
+int display_vsinkprint(display_sink_t *sink, const char *__restrict format, va_list args) {
+  if (!sink || !sink->write_fn || !format)
+    return -1;
+
+  return sink_vprint(sink, DISPLAY_LEVEL_NONE, format, args, 0, 0);
+}
+
+int display_vsinkprintln(display_sink_t *sink, const char *__restrict format, va_list args) {
+  if (!sink || !sink->write_fn || !format)
+    return -1;
+
+  return sink_vprint(sink, DISPLAY_LEVEL_NONE, format, args, 1, 0);
+}
+
+int display_vsinklog(display_sink_t *sink, int level, const char *__restrict format,
+                     va_list args) {
+  if (!sink || !sink->write_fn || !format)
+    return -1;
+
+  return sink_vprint(sink, level, format, args, 1, 0);
+}
+
+int display_sinkprint(display_sink_t *sink, const char *__restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = display_vsinkprint(sink, format, args);
+  va_end(args);
+
+  return result;
+}
+
+int display_sinkprintln(display_sink_t *sink, const char *__restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = display_vsinkprintln(sink, format, args);
+  va_end(args);
+
+  return result;
+}
+
+int display_sinklog(display_sink_t *sink, int level, const char *__restrict format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = display_vsinklog(sink, level, format, args);
+  va_end(args);
+
+  return result;
+}
+
+int display_sink_flush(display_sink_t *sink) {
+  if (!sink)
+    return -1;
+
+  return sink->flush_fn ? sink->flush_fn(sink->self) : 0;
+}
+
+int display_sink_close(display_sink_t *sink) {
+  if (!sink)
+    return -1;
+
+  return sink->close_fn ? sink->close_fn(sink->self) : display_sink_flush(sink);
+}
+
+typedef struct tee_t {
+  display_sink_t sink;
+  size_t count;
+  display_tee_child_t children[];
+
+} tee_t;
+
+static int tee_write(void *self, int level, const char *data, size_t len) {
+  tee_t *t = (tee_t *)self;
+  int result = 0;
+
+  for (size_t i = 0; i < t->count; i++) {
+    display_sink_t *child = t->children[i].sink;
+    if (level < t->children[i].min_level)
+      continue;
+    if (child->write_fn(child->self, level, data, len) == -1)
+      result = -1;
+  }
+
+  return result;
+}
+
+static int tee_flush(void *self) {
+  tee_t *t = (tee_t *)self;
+  int result = 0;
+
+  for (size_t i = 0; i < t->count; i++) {
+    if (display_sink_flush(t->children[i].sink) == -1)
+      result = -1;
+  }
+
+  return result;
+}
+
+static int tee_close(void *self) {
+  tee_t *t = (tee_t *)self;
+  int result = 0;
+
+  for (size_t i = 0; i < t->count; i++) {
+    if (display_sink_close(t->children[i].sink) == -1)
+      result = -1;
+  }
+
+  free(t);
+  return result;
+}
+
+display_sink_t *display_tee_open(const display_tee_child_t *children, size_t count) {
+  if (!children && count > 0)
+    return NULL;
+  for (size_t i = 0; i < count; i++) {
+    if (!children[i].sink)
+      return NULL;
+  }
+
+  tee_t *t = (tee_t *)malloc(sizeof(tee_t) + count * sizeof(display_tee_child_t));
+  if (!t)
+    return NULL;
+
+  t->sink = (display_sink_t){tee_write, tee_flush, tee_close, t};
+  t->count = count;
+  if (count > 0)
+    memcpy(t->children, children, count * sizeof(display_tee_child_t));
+  return &t->sink;
+}
+
+/// @brief CRC32C four bits at a time, reflected polynomial 0x82F63B78
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t *p, size_t len) {
+  static const uint32_t table[16] = {
+      0x00000000, 0x105EC76F, 0x20BD8EDE, 0x30E349B1, 0x417B1DBC, 0x5125DAD3,
+      0x61C69362, 0x7198540D, 0x82F63B78, 0x92A8FC17, 0xA24BB5A6, 0xB21572C9,
+      0xC38D26C4, 0xD3D3E1AB, 0xE330A81A, 0xF36E6F75};
+  for (size_t i = 0; i < len; i++) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ table[crc & 15];
+    crc = (crc >> 4) ^ table[crc & 15];
+  }
+  return crc;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define DISPLAY_CRC32C_SSE42 1
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p,
+                                                              size_t len) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+  crc = (uint32_t)crc64;
+#endif
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    crc = _mm_crc32_u32(crc, v);
+  }
+  for (; len > 0; p++, len--)
+    crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+#endif
+
+uint32_t display_crc32c(uint32_t crc, const void *data, size_t len) {
+  crc = ~crc;
+#ifdef DISPLAY_CRC32C_SSE42
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~crc32c_sse42(crc, (const uint8_t *)data, len);
+#endif
+  return ~crc32c_soft(crc, (const uint8_t *)data, len);
+}
+
+typedef struct framed_t {
+  display_sink_t sink;
+  display_sink_t *inner;
+
+  pthread_mutex_t lock; // Guards frame, for records too long for the stack
+  char *frame;
+  size_t frame_cap;
+
+} framed_t;
+
+static uint32_t frame_crc(const uint8_t *header, const char *data, size_t len) {
+  return display_crc32c(display_crc32c(0, header, 4), data, len);
+}
+
+static int framed_write(void *self, int level, const char *data, size_t len) {
+  framed_t *f = (framed_t *)self;
+  if (len > UINT32_MAX)
+    return -1;
+
+  // The frame reaches the inner sink in one write, like any record: mmap segments and rotated
+  // files never split a write, and an index counts writes as records
+  char inline_frame[DISPLAY_FRAME_HEADER + DISPLAY_STAGE_INLINE];
+  char *frame = inline_frame;
+  if (len > DISPLAY_STAGE_INLINE) {
+    // A buffer kept for the sink, only reallocated when a longer record comes
+    pthread_mutex_lock(&f->lock);
+    if (DISPLAY_FRAME_HEADER + len > f->frame_cap) {
+      char *grown = (char *)realloc(f->frame, DISPLAY_FRAME_HEADER + len);
+      if (!grown) {
+        pthread_mutex_unlock(&f->lock);
+        return -1;
+      }
+      f->frame = grown;
+      f->frame_cap = DISPLAY_FRAME_HEADER + len;
+    }
+    frame = f->frame;
+  }
+
+  store_le32((uint8_t *)frame, (uint32_t)len);
+  store_le32((uint8_t *)frame + 4, frame_crc((const uint8_t *)frame, data, len));
+  memcpy(frame + DISPLAY_FRAME_HEADER, data, len);
+  int result = f->inner->write_fn(f->inner->self, level, frame, DISPLAY_FRAME_HEADER + len);
+
+  if (frame != inline_frame)
+    pthread_mutex_unlock(&f->lock);
+  return result;
+}
+
+static int framed_flush(void *self) { return display_sink_flush(((framed_t *)self)->inner); }
+
+static int framed_close(void *self) {
+  framed_t *f = (framed_t *)self;
+  int result = display_sink_close(f->inner);
+
+  pthread_mutex_destroy(&f->lock);
+  free(f->frame);
+  free(f);
+  return result;
+}
+
+display_sink_t *display_framed_open(display_sink_t *inner) {
+  if (!inner)
+    return NULL;
+
+  framed_t *f = (framed_t *)calloc(1, sizeof(framed_t));
+  if (!f)
+    return NULL;
+  if (pthread_mutex_init(&f->lock, NULL) != 0) {
+    free(f);
+    return NULL;
+  }
+
+  f->sink = (display_sink_t){framed_write, framed_flush, framed_close, f};
+  f->inner = inner;
+  return &f->sink;
+}
+
+int display_frame_next(const char *buf, size_t size, size_t *pos, const char **record,
+                       size_t *len, size_t *skipped) {
+  if (!buf || !pos || !record || !len)
+    return 0;
+
+  // Most garbage is rejected by its length alone, the CRC is only computed when it fits
+  size_t p = *pos;
+  for (; p < size && size - p >= DISPLAY_FRAME_HEADER; p++) {
+    const uint8_t *header = (const uint8_t *)buf + p;
+    uint32_t n = load_le32(header);
+    if (n > size - p - DISPLAY_FRAME_HEADER ||
+        frame_crc(header, buf + p + DISPLAY_FRAME_HEADER, n) != load_le32(header + 4))
+      continue;
+
+    if (skipped)
+      *skipped += p - *pos;
+    *record = buf + p + DISPLAY_FRAME_HEADER;
+    *len = n;
+    *pos = p + DISPLAY_FRAME_HEADER + n;
+    return 1;
+  }
+
+  if (skipped && size > *pos)
+    *skipped += size - *pos;
+  if (size > *pos)
+    *pos = size;
+  return 0;
+}
+
+#ifndef _WIN32
+
+static uint64_t sink_now_ns(void) {
+  struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // A few ns through the vDSO, enough for max_age_us
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// @brief Writes all iovecs to fd, retrying on EINTR and partial writes
+/// @return 0 on success, -1 on failure
+static int writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+// The part shared by sinks that buffer records and flush them by a display_flush_policy_t
+typedef struct buffered_sink_t {
+  display_sink_t sink;
+  display_flush_policy_t policy;
+  pthread_mutex_t lock;
+  size_t pending;     // Bytes written but not flushed
+  uint64_t oldest_ns; // When the oldest pending byte was written
+  int (*flush_locked)(struct buffered_sink_t *b);
+  struct buffered_sink_t *next; // In the list flushed at exit or by the timer
+
+} buffered_sink_t;
+
+static buffered_sink_t *policy_list = NULL;
+static pthread_mutex_t policy_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t policy_exit_once = PTHREAD_ONCE_INIT;
+static int policy_timer_started = 0;
+
+/// @brief Resolves DISPLAY_FLUSH_AUTO for `fd`, once
+static display_flush_policy_t policy_resolve(const display_flush_policy_t *policy, int fd) {
+  display_flush_policy_t p = {DISPLAY_FLUSH_AUTO, 0, 0, DISPLAY_LEVEL_NONE};
+  if (policy)
+    p = *policy;
+  if (p.flags == DISPLAY_FLUSH_AUTO)
+    p.flags = isatty(fd) ? DISPLAY_FLUSH_NEWLINE | DISPLAY_FLUSH_EXIT : DISPLAY_FLUSH_EXIT;
+  return p;
+}
+
+/// @brief Accounts for a record just buffered and tells whether the policy wants a flush now.
+/// Called locked
+static int policy_on_write(buffered_sink_t *b, int level, const char *data, size_t len) {
+  const display_flush_policy_t *p = &b->policy;
+  uint64_t now = p->max_age_us ? sink_now_ns() : 0;
+  if (b->pending == 0)
+    b->oldest_ns = now;
+  b->pending += len;
+
+  return ((p->flags & DISPLAY_FLUSH_NEWLINE) && memchr(data, '\n', len)) ||
+         (p->max_bytes && b->pending >= p->max_bytes) ||
+         (p->min_level != DISPLAY_LEVEL_NONE && level >= p->min_level) ||
+         (p->max_age_us && now - b->oldest_ns >= (uint64_t)p->max_age_us * 1000);
+}
+
+static int policy_flush(buffered_sink_t *b) {
+  pthread_mutex_lock(&b->lock);
+  int result = b->pending > 0 ? b->flush_locked(b) : 0;
+  b->pending = 0;
+  pthread_mutex_unlock(&b->lock);
+
+  return result;
+}
+
+static void policy_flush_at_exit(void) {
+  pthread_mutex_lock(&policy_list_lock);
+  for (buffered_sink_t *b = policy_list; b; b = b->next) {
+    if (b->policy.flags & DISPLAY_FLUSH_EXIT)
+      b->sink.flush_fn(b->sink.self); // Not policy_flush: asynchronous sinks wait for their writes
+  }
+  pthread_mutex_unlock(&policy_list_lock);
+}
+
+static void policy_register_exit(void) { atexit(policy_flush_at_exit); }
+
+/// @brief Flushes sinks whose oldest pending byte is older than their max_age_us. Runs for the
+/// whole process, waking up at the smallest max_age_us / 2 of the registered sinks
+static void *policy_timer_main(void *arg) {
+  (void)arg;
+  for (;;) {
+    uint64_t period_us = 100000, now = sink_now_ns();
+
+    pthread_mutex_lock(&policy_list_lock);
+    for (buffered_sink_t *b = policy_list; b; b = b->next) {
+      if (!(b->policy.flags & DISPLAY_FLUSH_TIMER) || !b->policy.max_age_us)
+        continue;
+      if (b->policy.max_age_us / 2 < period_us)
+        period_us = b->policy.max_age_us / 2;
+
+      pthread_mutex_lock(&b->lock);
+      if (b->pending > 0 && now - b->oldest_ns >= (uint64_t)b->policy.max_age_us * 1000) {
+        b->flush_locked(b);
+        b->pending = 0;
+      }
+      pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_unlock(&policy_list_lock);
+
+    if (period_us < 100)
+      period_us = 100;
+    struct timespec ts = {(time_t)(period_us / 1000000), (long)(period_us % 1000000) * 1000};
+    nanosleep(&ts, NULL);
+  }
+
+  return NULL;
+}
+
+/// @brief Sets up the shared part of a buffered sink and registers it for exit/timer flushing
+/// @return 0 on success, -1 on failure
+static int policy_attach(buffered_sink_t *b, const display_flush_policy_t *policy, int fd) {
+  b->policy = policy_resolve(policy, fd);
+  if (pthread_mutex_init(&b->lock, NULL) != 0)
+    return -1;
+  if (!(b->policy.flags & (DISPLAY_FLUSH_EXIT | DISPLAY_FLUSH_TIMER)))
+    return 0;
+
+  pthread_once(&policy_exit_once, policy_register_exit);
+  pthread_mutex_lock(&policy_list_lock);
+  b->next = policy_list;
+  policy_list = b;
+  if ((b->policy.flags & DISPLAY_FLUSH_TIMER) && b->policy.max_age_us && !policy_timer_started) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, policy_timer_main, NULL) == 0) {
+      pthread_detach(thread);
+      policy_timer_started = 1;
+    }
+  }
+  pthread_mutex_unlock(&policy_list_lock);
+
+  return 0;
+}
+
+/// @brief Flushes the sink and removes it from the exit/timer list
+static int policy_detach(buffered_sink_t *b) {
+  int result = policy_flush(b);
+
+  pthread_mutex_lock(&policy_list_lock);
+  for (buffered_sink_t **it = &policy_list; *it; it = &(*it)->next) {
+    if (*it == b) {
+      *it = b->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&policy_list_lock);
+
+  pthread_mutex_destroy(&b->lock);
+  return result;
+}
+
+typedef struct fdbuf_t {
+  buffered_sink_t base;
+  int fd;
+  char *buf;
+  size_t len, cap;
+
+} fdbuf_t;
+
+/// @brief Writes the buffer, followed by `data` if any, with one syscall. Called locked
+static int fdbuf_write_out(fdbuf_t *f, const char *data, size_t len) {
+  struct iovec iov[2];
+  int iovcnt = 0;
+  if (f->len > 0)
+    iov[iovcnt++] = (struct iovec){f->buf, f->len};
+  if (len > 0)
+    iov[iovcnt++] = (struct iovec){(void *)data, len};
+
+  DISPLAY_PROBE2(flush, f, f->len + len);
+  int result = writev_all(f->fd, iov, iovcnt);
+  f->len = 0;
+  f->base.pending = 0;
+  return result;
+}
+
+static int fdbuf_flush_locked(buffered_sink_t *b) { return fdbuf_write_out((fdbuf_t *)b, NULL, 0); }
+
+static int fdbuf_write(void *self, int level, const char *data, size_t len) {
+  fdbuf_t *f = (fdbuf_t *)self;
+  int result = 0;
+
+  pthread_mutex_lock(&f->base.lock);
+  if (len > f->cap - f->len) {
+    result = fdbuf_write_out(f, data, len);
+  } else {
+    memcpy(f->buf + f->len, data, len);
+    f->len += len;
+    if (policy_on_write(&f->base, level, data, len))
+      result = fdbuf_write_out(f, NULL, 0);
+  }
+  pthread_mutex_unlock(&f->base.lock);
+
+  return result;
+}
+
+static int fdbuf_flush(void *self) { return policy_flush((buffered_sink_t *)self); }
+
+static int fdbuf_close(void *self) {
+  fdbuf_t *f = (fdbuf_t *)self;
+  int result = policy_detach(&f->base);
+
+  free(f->buf);
+  free(f);
+  return result;
+}
+
+display_sink_t *display_fdbuf_open(int fd, size_t capacity, const display_flush_policy_t *policy) {
+  if (fd < 0)
+    return NULL;
+  if (capacity == 0)
+    capacity = 64 * 1024;
+
+  fdbuf_t *f = (fdbuf_t *)calloc(1, sizeof(fdbuf_t));
+  if (!f)
+    return NULL;
+  f->buf = (char *)malloc(capacity);
+  if (!f->buf || policy_attach(&f->base, policy, fd) == -1) {
+    free(f->buf);
+    free(f);
+    return NULL;
+  }
+
+  f->base.sink = (display_sink_t){fdbuf_write, fdbuf_flush, fdbuf_close, f};
+  f->base.flush_locked = fdbuf_flush_locked;
+  f->fd = fd;
+  f->cap = capacity;
+  return &f->base.sink;
+}
+
+typedef struct file_sink_t {
+  buffered_sink_t base;
+  FILE *file;
+
+} file_sink_t;
+
+static int file_sink_flush_locked(buffered_sink_t *b) {
+  DISPLAY_PROBE2(flush, b, b->pending);
+  return fflush(((file_sink_t *)b)->file) == 0 ? 0 : -1;
+}
+
+static int file_sink_write(void *self, int level, const char *data, size_t len) {
+  file_sink_t *f = (file_sink_t *)self;
+  int result = 0;
+
+  pthread_mutex_lock(&f->base.lock);
+  if (fwrite(data, 1, len, f->file) != len)
+    result = -1;
+  if (policy_on_write(&f->base, level, data, len)) {
+    if (file_sink_flush_locked(&f->base) == -1)
+      result = -1;
+    f->base.pending = 0;
+  }
+  pthread_mutex_unlock(&f->base.lock);
+
+  return result;
+}
+
+static int file_sink_flush(void *self) { return policy_flush((buffered_sink_t *)self); }
+
+static int file_sink_close(void *self) {
+  file_sink_t *f = (file_sink_t *)self;
+  int result = policy_detach(&f->base);
+
+  free(f);
+  return result;
+}
+
+display_sink_t *display_file_sink_open(FILE *file, const display_flush_policy_t *policy) {
+  if (!file)
+    return NULL;
+
+  file_sink_t *f = (file_sink_t *)calloc(1, sizeof(file_sink_t));
+  if (!f)
+    return NULL;
+  if (policy_attach(&f->base, policy, fileno(file)) == -1) {
+    free(f);
+    return NULL;
+  }
+
+  f->base.sink = (display_sink_t){file_sink_write, file_sink_flush, file_sink_close, f};
+  f->base.flush_locked = file_sink_flush_locked;
+  f->file = file;
+  return &f->base.sink;
+}
+
+typedef struct durable_t {
+  display_sink_t sink;
+  int fd;
+  size_t max_batch;
+  uint64_t max_delay_ns;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // Committer: records pending, a waiter, or stopping
+  pthread_cond_t space; // Producers: the batch buffer was handed to the committer
+  pthread_cond_t done;  // Waiters: durable_seq advanced
+  pthread_t committer;
+
+  char *buf[2]; // buf[active] collects records while the committer writes the other one
+  size_t cap[2];
+  int active;
+  size_t len;         // Bytes in buf[active]
+  uint64_t oldest_ns; // When the first record in buf[active] was written
+  uint64_t appended_seq, durable_seq;
+  int force, stop, failed;
+
+} durable_t;
+
+static __thread uint64_t durable_last_ticket = 0; // Set by durable_write for the calling thread
+
+static void sink_timespec(struct timespec *ts, uint64_t ns) {
+  ts->tv_sec = (time_t)(ns / 1000000000ull);
+  ts->tv_nsec = (long)(ns % 1000000000ull);
+}
+
+static uint64_t sink_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *durable_commit_main(void *arg) {
+  durable_t *d = (durable_t *)arg;
+
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (!d->stop && !(d->len > 0 && (d->force || d->len >= d->max_batch ||
+                                        sink_monotonic_ns() - d->oldest_ns >= d->max_delay_ns))) {
+      if (d->len == 0) {
+        pthread_cond_wait(&d->work, &d->lock);
+      } else {
+        struct timespec ts;
+        sink_timespec(&ts, d->oldest_ns + d->max_delay_ns);
+        pthread_cond_timedwait(&d->work, &d->lock, &ts);
+      }
+    }
+    if (d->len == 0 && d->stop)
+      break;
+
+    // Hand the batch over and let producers continue in the other buffer
+    struct iovec iov = {d->buf[d->active], d->len};
+    uint64_t batch_seq = d->appended_seq;
+    d->active ^= 1;
+    d->len = 0;
+    d->force = 0;
+    pthread_cond_broadcast(&d->space);
+    pthread_mutex_unlock(&d->lock);
+
+    DISPLAY_PROBE2(flush, d, iov.iov_len);
+    int result = writev_all(d->fd, &iov, 1);
+    if (result == 0)
+      result = fdatasync(d->fd);
+
+    pthread_mutex_lock(&d->lock);
+    if (result != 0)
+      d->failed = 1;
+    d->durable_seq = batch_seq;
+    pthread_cond_broadcast(&d->done);
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  return NULL;
+}
+
+static int durable_write(void *self, int level, const char *data, size_t len) {
+  durable_t *d = (durable_t *)self;
+  (void)level;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->failed) { // Sticky: records written after a failed batch could never be relied on
+    pthread_mutex_unlock(&d->lock);
+    return -1;
+  }
+  // Wait for the committer to take the batch instead of growing it without bound
+  while (d->len > 0 && d->len + len > d->cap[d->active] && !d->stop) {
+    d->force = 1;
+    pthread_cond_signal(&d->work);
+    pthread_cond_wait(&d->space, &d->lock);
+  }
+  if (len > d->cap[d->active]) { // A record larger than the whole buffer
+    char *buf = (char *)realloc(d->buf[d->active], len);
+    if (!buf) {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    d->buf[d->active] = buf;
+    d->cap[d->active] = len;
+  }
+
+  memcpy(d->buf[d->active] + d->len, data, len);
+  if (d->len == 0) {
+    d->oldest_ns = sink_monotonic_ns();
+    pthread_cond_signal(&d->work); // Starts the max_delay_us clock of the committer
+  }
+  d->len += len;
+  durable_last_ticket = ++d->appended_seq;
+  if (d->len >= d->max_batch)
+    pthread_cond_signal(&d->work);
+  pthread_mutex_unlock(&d->lock);
+
+  return 0;
+}
+
+int display_durable_wait(display_sink_t *sink, uint64_t ticket) {
+  if (!sink)
+    return -1;
+  durable_t *d = (durable_t *)sink->self;
+
+  pthread_mutex_lock(&d->lock);
+  while (d->durable_seq < ticket && !d->stop) {
+    d->force = 1; // Someone is blocked on it: do not wait for max_delay_us
+    pthread_cond_signal(&d->work);
+    pthread_cond_wait(&d->done, &d->lock);
+  }
+  int result = d->failed || d->durable_seq < ticket ? -1 : 0;
+  pthread_mutex_unlock(&d->lock);
+
+  return result;
+}
+
+static int durable_flush(void *self) {
+  durable_t *d = (durable_t *)self;
+
+  pthread_mutex_lock(&d->lock);
+  uint64_t ticket = d->appended_seq;
+  pthread_mutex_unlock(&d->lock);
+
+  return display_durable_wait(&d->sink, ticket);
+}
+
+static int durable_close(void *self) {
+  durable_t *d = (durable_t *)self;
+  int result = durable_flush(d);
+
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->work);
+  pthread_cond_broadcast(&d->space);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->committer, NULL);
+
+  if (close(d->fd) != 0)
+    result = -1;
+  pthread_cond_destroy(&d->work);
+  pthread_cond_destroy(&d->space);
+  pthread_cond_destroy(&d->done);
+  pthread_mutex_destroy(&d->lock);
+  free(d->buf[0]);
+  free(d->buf[1]);
+  free(d);
+  return result;
+}
+
+display_sink_t *display_durable_open(const char *path, size_t max_batch_bytes,
+                                     unsigned max_delay_us) {
+  if (!path)
+    return NULL;
+  if (max_batch_bytes == 0)
+    max_batch_bytes = 256 * 1024;
+
+  durable_t *d = (durable_t *)calloc(1, sizeof(durable_t));
+  if (!d)
+    return NULL;
+
+  d->sink = (display_sink_t){durable_write, durable_flush, durable_close, d};
+  d->max_batch = max_batch_bytes;
+  d->max_delay_ns = (uint64_t)max_delay_us * 1000ull;
+  d->cap[0] = d->cap[1] = 2 * max_batch_bytes;
+  d->buf[0] = (char *)malloc(d->cap[0]);
+  d->buf[1] = (char *)malloc(d->cap[1]);
+  d->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // For the max_delay_us deadline
+  int ok = d->buf[0] && d->buf[1] && d->fd >= 0 && pthread_mutex_init(&d->lock, NULL) == 0;
+  ok = ok && pthread_cond_init(&d->work, &attr) == 0 && pthread_cond_init(&d->space, NULL) == 0 &&
+       pthread_cond_init(&d->done, NULL) == 0;
+  ok = ok && pthread_create(&d->committer, NULL, durable_commit_main, d) == 0;
+  pthread_condattr_destroy(&attr);
+
+  if (!ok) {
+    if (d->fd >= 0)
+      close(d->fd);
+    free(d->buf[0]);
+    free(d->buf[1]);
+    free(d);
+    return NULL;
+  }
+
+  return &d->sink;
+}
+
+int display_durable_println(display_sink_t *sink, uint64_t *ticket,
+                            const char *__restrict format, ...) {
+  if (!sink || !format)
+    return -1;
+
+  va_list args;
+  va_start(args, format);
+  int result = sink_vprint(sink, DISPLAY_LEVEL_NONE, format, args, 1, 0);
+  va_end(args);
+
+  if (ticket)
+    *ticket = result == -1 ? 0 : durable_last_ticket;
+  return result;
+}
+
+typedef struct nonblock_t {
+  display_sink_t sink;
+  int fd, fd_flags; // fd_flags: as they were before O_NONBLOCK, restored on close
+  int overflow;
+  unsigned block_timeout_ms;
+
+  pthread_mutex_t lock;
+  pthread_cond_t pending; // Helper: the ring is not empty
+  pthread_cond_t drained; // Blocked producers: the helper made room
+  pthread_t helper;
+  int has_helper, stop;
+  int error; // Sticky: writing to the fd failed, the buffer was discarded
+
+  char *ring; // Bytes not accepted by the reader yet, from head to head + len (mod cap)
+  size_t cap, head, len;
+  uint64_t dropped;
+
+} nonblock_t;
+
+/// @brief Marks the sink failed and discards the ring, whose bytes can no longer be written
+static void nonblock_fail(nonblock_t *n) {
+  if (n->len > 0)
+    DISPLAY_PROBE2(drop, n, n->len);
+  n->error = 1;
+  n->head = 0;
+  n->len = 0;
+}
+
+/// @brief Writes as much of the ring as the fd accepts without blocking. Called locked
+/// @return 0 when the ring is empty or the fd is full, -1 on a write error, now or before
+static int nonblock_drain(nonblock_t *n) {
+  if (n->error)
+    return -1;
+
+  while (n->len > 0) {
+    size_t first = n->cap - n->head < n->len ? n->cap - n->head : n->len;
+    struct iovec iov[2] = {{n->ring + n->head, first}, {n->ring, n->len - first}};
+    ssize_t w = writev(n->fd, iov, n->len > first ? 2 : 1);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      nonblock_fail(n);
+      return -1;
+    }
+
+    DISPLAY_PROBE2(flush, n, w);
+    n->head = (n->head + (size_t)w) % n->cap;
+    n->len -= (size_t)w;
+  }
+
+  n->head = 0;
+  return 0;
+}
+
+static void nonblock_push(nonblock_t *n, const char *data, size_t len) {
+  size_t tail = (n->head + n->len) % n->cap;
+  size_t first = n->cap - tail < len ? n->cap - tail : len;
+  memcpy(n->ring + tail, data, first);
+  memcpy(n->ring, data + first, len - first);
+  n->len += len;
+}
+
+static int nonblock_write(void *self, int level, const char *data, size_t len) {
+  nonblock_t *n = (nonblock_t *)self;
+  (void)level;
+  int result = 0;
+
+  pthread_mutex_lock(&n->lock);
+  if (n->len > 0 && !n->has_helper)
+    result = nonblock_drain(n);
+  if (n->error) {
+    pthread_mutex_unlock(&n->lock);
+    return -1;
+  }
+
+  if (n->len == 0 && len <= n->cap) {
+    // Straight to the fd, keeping whatever it does not take
+    size_t done = 0;
+    while (done < len) {
+      ssize_t w = write(n->fd, data + done, len - done);
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        nonblock_fail(n);
+        result = -1;
+      }
+      if (w < 0)
+        break;
+      done += (size_t)w;
+    }
+    if (result != -1 && done < len) {
+      nonblock_push(n, data + done, len - done);
+      if (n->has_helper)
+        pthread_cond_signal(&n->pending);
+    }
+    pthread_mutex_unlock(&n->lock);
+    return result;
+  }
+
+  if (len > n->cap - n->len && len <= n->cap && n->overflow == DISPLAY_OVERFLOW_BLOCK) {
+    uint64_t deadline = sink_now_ns() + (uint64_t)n->block_timeout_ms * 1000000ull;
+    while (len > n->cap - n->len && result != -1 && !n->error && !n->stop) {
+      uint64_t now = sink_now_ns();
+      if (now >= deadline)
+        break;
+
+      if (n->has_helper) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_nsec + (deadline - now);
+        ts.tv_sec += (time_t)(ns / 1000000000ull);
+        ts.tv_nsec = (long)(ns % 1000000000ull);
+        pthread_cond_timedwait(&n->drained, &n->lock, &ts);
+      } else {
+        pthread_mutex_unlock(&n->lock);
+        struct pollfd pfd = {n->fd, POLLOUT, 0};
+        poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+        pthread_mutex_lock(&n->lock);
+        result = nonblock_drain(n);
+      }
+    }
+  }
+
+  if (n->error) {
+    result = -1;
+  } else if (len <= n->cap - n->len) {
+    nonblock_push(n, data, len);
+    if (n->has_helper)
+      pthread_cond_signal(&n->pending);
+  } else {
+    DISPLAY_PROBE2(drop, n, len);
+    n->dropped++;
+  }
+  pthread_mutex_unlock(&n->lock);
+
+  return result;
+}
+
+static void *nonblock_helper_main(void *arg) {
+  nonblock_t *n = (nonblock_t *)arg;
+
+  pthread_mutex_lock(&n->lock);
+  while (!n->stop) {
+    if (n->len == 0) {
+      pthread_cond_wait(&n->pending, &n->lock);
+      continue;
+    }
+
+    pthread_mutex_unlock(&n->lock);
+    struct pollfd pfd = {n->fd, POLLOUT, 0};
+    poll(&pfd, 1, 100);
+    pthread_mutex_lock(&n->lock);
+
+    // On failure the ring is emptied, so the helper goes back to waiting instead of polling a
+    // broken fd
+    nonblock_drain(n);
+    pthread_cond_broadcast(&n->drained);
+  }
+  pthread_mutex_unlock(&n->lock);
+
+  return NULL;
+}
+
+static int nonblock_flush(void *self) {
+  nonblock_t *n = (nonblock_t *)self;
+
+  pthread_mutex_lock(&n->lock);
+  int result = nonblock_drain(n);
+  pthread_mutex_unlock(&n->lock);
+
+  return result;
+}
+
+uint64_t display_nonblock_dropped(display_sink_t *sink) {
+  if (!sink)
+    return 0;
+  nonblock_t *n = (nonblock_t *)sink->self;
+
+  pthread_mutex_lock(&n->lock);
+  uint64_t dropped = n->dropped;
+  pthread_mutex_unlock(&n->lock);
+
+  return dropped;
+}
+
+static int nonblock_close(void *self) {
+  nonblock_t *n = (nonblock_t *)self;
+
+  pthread_mutex_lock(&n->lock);
+  n->stop = 1;
+  pthread_cond_broadcast(&n->pending);
+  pthread_cond_broadcast(&n->drained);
+  pthread_mutex_unlock(&n->lock);
+  if (n->has_helper)
+    pthread_join(n->helper, NULL);
+
+  // Give the reader up to block_timeout_ms to take the rest
+  uint64_t deadline = sink_now_ns() + (uint64_t)n->block_timeout_ms * 1000000ull;
+  int result = nonblock_drain(n);
+  while (result == 0 && n->len > 0 && sink_now_ns() < deadline) {
+    struct pollfd pfd = {n->fd, POLLOUT, 0};
+    poll(&pfd, 1, 10);
+    result = nonblock_drain(n);
+  }
+  if (n->len > 0) {
+    DISPLAY_PROBE2(drop, n, n->len);
+    result = -1;
+  }
+
+  fcntl(n->fd, F_SETFL, n->fd_flags);
+  pthread_cond_destroy(&n->pending);
+  pthread_cond_destroy(&n->drained);
+  pthread_mutex_destroy(&n->lock);
+  free(n->ring);
+  free(n);
+  return result;
+}
+
+display_sink_t *display_nonblock_open(int fd, size_t capacity, int overflow,
+                                      unsigned block_timeout_ms, int helper) {
+  int flags = fd < 0 ? -1 : fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return NULL;
+  if (capacity == 0)
+    capacity = 1024 * 1024;
+
+  nonblock_t *n = (nonblock_t *)calloc(1, sizeof(nonblock_t));
+  if (!n)
+    return NULL;
+  n->ring = (char *)malloc(capacity);
+  if (!n->ring || pthread_mutex_init(&n->lock, NULL) != 0) {
+    free(n->ring);
+    free(n);
+    return NULL;
+  }
+  pthread_cond_init(&n->pending, NULL);
+  pthread_cond_init(&n->drained, NULL);
+
+  n->sink = (display_sink_t){nonblock_write, nonblock_flush, nonblock_close, n};
+  n->fd = fd;
+  n->fd_flags = flags;
+  n->overflow = overflow;
+  n->block_timeout_ms = block_timeout_ms;
+  n->cap = capacity;
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  if (helper && pthread_create(&n->helper, NULL, nonblock_helper_main, n) == 0)
+    n->has_helper = 1;
+
+  return &n->sink;
+}
+
+typedef struct mmap_segment_t {
+  char *base;
+  size_t size;
+  int fd;
+  atomic_size_t reserved; // Next free offset, may run past `size` once the segment is full
+  atomic_int writers;     // Writers holding the segment, it is unmapped once they are done
+  atomic_size_t used;     // Offset of the first record that did not fit, set by its writer
+
+  // Unmapped segments are only freed on close: a writer may still take and drop a reference
+  struct mmap_segment_t *retired;
+
+} mmap_segment_t;
+
+typedef struct mmap_sink_t {
+  display_sink_t sink;
+  char *path;
+  size_t segment_size;
+  unsigned next_index;
+  _Atomic(mmap_segment_t *) current;
+  mmap_segment_t *retired;
+  pthread_mutex_t roll_lock; // Taken only to start the next segment
+
+} mmap_sink_t;
+
+static mmap_segment_t *mmap_segment_open(mmap_sink_t *m) {
+  size_t size = strlen(m->path) + 16;
+  char *name = (char *)malloc(size);
+  mmap_segment_t *seg = (mmap_segment_t *)calloc(1, sizeof(mmap_segment_t));
+  if (!name || !seg) {
+    free(name);
+    free(seg);
+    return NULL;
+  }
+
+  snprintf(name, size, "%s.%u", m->path, m->next_index);
+  seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  free(name);
+  if (seg->fd < 0 || posix_fallocate(seg->fd, 0, (off_t)m->segment_size) != 0 ||
+      (seg->base = (char *)mmap(NULL, m->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                seg->fd, 0)) == MAP_FAILED) {
+    if (seg->fd >= 0)
+      close(seg->fd);
+    free(seg);
+    return NULL;
+  }
+
+  seg->size = m->segment_size;
+  atomic_init(&seg->used, m->segment_size);
+  atomic_init(&seg->reserved, 0);
+  atomic_init(&seg->writers, 0);
+  m->next_index++;
+  return seg;
+}
+
+/// @brief Waits for the writers still copying into the segment, then unmaps it and truncates
+/// its file to the used length
+/// @note  The writer of the record that did not fit sets `used` before dropping its reference,
+///        so it is only read once there are no writers left
+static int mmap_segment_close(mmap_segment_t *seg) {
+  while (atomic_load_explicit(&seg->writers, memory_order_acquire) > 0)
+    sched_yield();
+
+  size_t used = atomic_load_explicit(&seg->used, memory_order_relaxed);
+  size_t reserved = atomic_load_explicit(&seg->reserved, memory_order_relaxed);
+  if (reserved < used)
+    used = reserved;
+
+  DISPLAY_PROBE2(flush, seg, used);
+  int result = munmap(seg->base, seg->size);
+  if (ftruncate(seg->fd, (off_t)used) != 0)
+    result = -1;
+  if (close(seg->fd) != 0)
+    result = -1;
+  return result;
+}
+
+/// @brief Takes a reference on the current segment, so it is not unmapped while in use
+static mmap_segment_t *mmap_acquire(mmap_sink_t *m) {
+  for (;;) {
+    mmap_segment_t *seg = atomic_load_explicit(&m->current, memory_order_acquire);
+    if (!seg)
+      return NULL;
+
+    atomic_fetch_add_explicit(&seg->writers, 1, memory_order_acq_rel);
+    if (atomic_load_explicit(&m->current, memory_order_acquire) == seg)
+      return seg;
+    atomic_fetch_sub_explicit(&seg->writers, 1, memory_order_release);
+  }
+}
+
+static int mmap_write(void *self, int level, const char *data, size_t len) {
+  mmap_sink_t *m = (mmap_sink_t *)self;
+  (void)level;
+  if (len > m->segment_size)
+    return -1;
+
+  for (;;) {
+    mmap_segment_t *seg = mmap_acquire(m);
+    if (!seg)
+      return -1;
+
+    size_t off = atomic_fetch_add_explicit(&seg->reserved, len, memory_order_acq_rel);
+    if (off + len <= seg->size) {
+      memcpy(seg->base + off, data, len);
+      atomic_fetch_sub_explicit(&seg->writers, 1, memory_order_release);
+      return 0;
+    }
+
+    // Reservations are contiguous, so exactly one failed reservation starts inside the segment
+    if (off <= seg->size)
+      atomic_store_explicit(&seg->used, off, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&seg->writers, 1, memory_order_release);
+
+    pthread_mutex_lock(&m->roll_lock);
+    int result = 0;
+    if (atomic_load_explicit(&m->current, memory_order_acquire) == seg) {
+      mmap_segment_t *next = mmap_segment_open(m);
+      if (next) {
+        atomic_store_explicit(&m->current, next, memory_order_release);
+        result = mmap_segment_close(seg);
+        seg->retired = m->retired;
+        m->retired = seg;
+      } else {
+        result = -1;
+      }
+    }
+    pthread_mutex_unlock(&m->roll_lock);
+    if (result == -1)
+      return -1;
+  }
+}
+
+static int mmap_flush(void *self) {
+  mmap_sink_t *m = (mmap_sink_t *)self;
+  mmap_segment_t *seg = mmap_acquire(m);
+  if (!seg)
+    return -1;
+
+  int result = msync(seg->base, seg->size, MS_ASYNC);
+  atomic_fetch_sub_explicit(&seg->writers, 1, memory_order_release);
+  return result;
+}
+
+static int mmap_close(void *self) {
+  mmap_sink_t *m = (mmap_sink_t *)self;
+
+  pthread_mutex_lock(&m->roll_lock);
+  mmap_segment_t *seg = atomic_exchange_explicit(&m->current, NULL, memory_order_acq_rel);
+  int result = 0;
+  if (seg) {
+    result = mmap_segment_close(seg);
+    free(seg);
+  }
+  pthread_mutex_unlock(&m->roll_lock);
+
+  while (m->retired) {
+    seg = m->retired;
+    m->retired = seg->retired;
+    free(seg);
+  }
+
+  pthread_mutex_destroy(&m->roll_lock);
+  free(m->path);
+  free(m);
+  return result;
+}
+
+display_sink_t *display_mmap_open(const char *path, size_t segment_size) {
+  if (!path)
+    return NULL;
+  if (segment_size == 0)
+    segment_size = 64 * 1024 * 1024;
+
+  mmap_sink_t *m = (mmap_sink_t *)calloc(1, sizeof(mmap_sink_t));
+  if (!m)
+    return NULL;
+  m->path = (char *)malloc(strlen(path) + 1);
+  if (!m->path || pthread_mutex_init(&m->roll_lock, NULL) != 0) {
+    free(m->path);
+    free(m);
+    return NULL;
+  }
+  strcpy(m->path, path);
+  m->segment_size = segment_size;
+
+  mmap_segment_t *seg = mmap_segment_open(m);
+  if (!seg) {
+    pthread_mutex_destroy(&m->roll_lock);
+    free(m->path);
+    free(m);
+    return NULL;
+  }
+
+  atomic_init(&m->current, seg);
+  m->sink = (display_sink_t){mmap_write, mmap_flush, mmap_close, m};
+  return &m->sink;
+}
+
+// One open file of a rotating sink. Two of them take turns, so a writer that read the old
+// pointer can always take and drop its reference safely
+typedef struct rotate_gen_t {
+  int fd;
+  atomic_size_t bytes;
+  atomic_int writers;
+  uint64_t opened_ns;
+
+} rotate_gen_t;
+
+typedef struct rotate_t {
+  display_sink_t sink;
+  char *path, *rotated_path; // rotated_path: room for "<path>.<n>"
+  size_t max_bytes;
+  uint64_t max_age_ns;
+  void (*on_rotated)(const char *rotated_path, void *arg);
+  void *arg;
+
+  rotate_gen_t gen[2];
+  _Atomic(rotate_gen_t *) current;
+  unsigned next_index;
+
+  pthread_mutex_t lock; // Only for waking the rotator
+  pthread_cond_t wake;
+  pthread_t rotator;
+  int stop, due;
+  atomic_int failed; // The last rotation failed, it is retried after a backoff
+
+} rotate_t;
+
+static rotate_gen_t *rotate_acquire(rotate_t *r) {
+  for (;;) {
+    rotate_gen_t *gen = atomic_load_explicit(&r->current, memory_order_acquire);
+    atomic_fetch_add_explicit(&gen->writers, 1, memory_order_acq_rel);
+    if (atomic_load_explicit(&r->current, memory_order_acquire) == gen)
+      return gen;
+    atomic_fetch_sub_explicit(&gen->writers, 1, memory_order_release);
+  }
+}
+
+static int rotate_write(void *self, int level, const char *data, size_t len) {
+  rotate_t *r = (rotate_t *)self;
+  (void)level;
+
+  rotate_gen_t *gen = rotate_acquire(r);
+  struct iovec iov = {(void *)data, len};
+  int result = writev_all(gen->fd, &iov, 1);
+  size_t bytes = atomic_fetch_add_explicit(&gen->bytes, len, memory_order_relaxed) + len;
+  atomic_fetch_sub_explicit(&gen->writers, 1, memory_order_release);
+
+  // Only the record crossing the threshold wakes the rotator, which keeps retrying until the
+  // rotation succeeds
+  if (r->max_bytes && bytes >= r->max_bytes && bytes - len < r->max_bytes) {
+    pthread_mutex_lock(&r->lock);
+    r->due = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+  }
+
+  if (atomic_load_explicit(&r->failed, memory_order_relaxed))
+    result = -1;
+  return result;
+}
+
+/// @brief Renames the file to the next free `<path>.<n>`, opens a new one and swaps them.
+/// Runs on the rotator thread
+static int rotate_now(rotate_t *r) {
+  rotate_gen_t *old = atomic_load_explicit(&r->current, memory_order_acquire);
+  rotate_gen_t *next = old == &r->gen[0] ? &r->gen[1] : &r->gen[0];
+
+  struct stat st;
+  size_t size = strlen(r->path) + 16;
+  do {
+    snprintf(r->rotated_path, size, "%s.%u", r->path, r->next_index++);
+  } while (stat(r->rotated_path, &st) == 0);
+
+  // Writes that still go to the old fd land in the renamed file, so nothing is lost
+  if (rename(r->path, r->rotated_path) != 0) {
+    r->next_index--; // Free again for the retry
+    return -1;
+  }
+  int fd = open(r->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    rename(r->rotated_path, r->path); // So that the retry finds the file where it was
+    r->next_index--;
+    return -1;
+  }
+
+  next->fd = fd;
+  atomic_store_explicit(&next->bytes, 0, memory_order_relaxed);
+  next->opened_ns = sink_monotonic_ns();
+  atomic_store_explicit(&r->current, next, memory_order_release);
+
+  while (atomic_load_explicit(&old->writers, memory_order_acquire) > 0)
+    sched_yield();
+  DISPLAY_PROBE2(flush, r, atomic_load_explicit(&old->bytes, memory_order_relaxed));
+  close(old->fd);
+
+  if (r->on_rotated)
+    r->on_rotated(r->rotated_path, r->arg);
+  return 0;
+}
+
+#define ROTATE_RETRY_NS 1000000000ull      // First wait after a failed rotation
+#define ROTATE_RETRY_MAX_NS 60000000000ull // Longest one, the wait doubles in between
+
+static void *rotate_main(void *arg) {
+  rotate_t *r = (rotate_t *)arg;
+  uint64_t backoff = 0, retry_at = 0;
+
+  pthread_mutex_lock(&r->lock);
+  while (!r->stop) {
+    rotate_gen_t *gen = atomic_load_explicit(&r->current, memory_order_acquire);
+    uint64_t deadline = gen->opened_ns + r->max_age_ns;
+    uint64_t now = sink_monotonic_ns();
+    if (r->due && now < retry_at) {
+      struct timespec ts;
+      sink_timespec(&ts, retry_at);
+      pthread_cond_timedwait(&r->wake, &r->lock, &ts);
+      continue;
+    }
+
+    if (!r->due && r->max_age_ns && now >= deadline) {
+      if (atomic_load_explicit(&gen->bytes, memory_order_relaxed) > 0) {
+        r->due = 1;
+      } else { // Empty files are not rotated, give it another max_age_s
+        gen->opened_ns = now;
+        deadline = now + r->max_age_ns;
+      }
+    }
+
+    if (!r->due) {
+      if (r->max_age_ns) {
+        struct timespec ts;
+        sink_timespec(&ts, deadline);
+        pthread_cond_timedwait(&r->wake, &r->lock, &ts);
+      } else {
+        pthread_cond_wait(&r->wake, &r->lock);
+      }
+      continue;
+    }
+
+    r->due = 0;
+    pthread_mutex_unlock(&r->lock);
+    int result = rotate_now(r);
+    pthread_mutex_lock(&r->lock);
+
+    if (result == -1) {
+      backoff = backoff ? backoff * 2 : ROTATE_RETRY_NS;
+      if (backoff > ROTATE_RETRY_MAX_NS)
+        backoff = ROTATE_RETRY_MAX_NS;
+      retry_at = sink_monotonic_ns() + backoff;
+      r->due = 1;
+    } else {
+      backoff = 0;
+    }
+    atomic_store_explicit(&r->failed, result == -1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  return NULL;
+}
+
+static int rotate_close(void *self) {
+  rotate_t *r = (rotate_t *)self;
+
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->rotator, NULL);
+
+  rotate_gen_t *gen = atomic_load_explicit(&r->current, memory_order_acquire);
+  int result = close(gen->fd) == 0 ? 0 : -1;
+  pthread_cond_destroy(&r->wake);
+  pthread_mutex_destroy(&r->lock);
+  free(r->path);
+  free(r->rotated_path);
+  free(r);
+  return result;
+}
+
+display_sink_t *display_rotate_open(const char *path, size_t max_bytes, unsigned max_age_s,
+                                    void (*on_rotated)(const char *rotated_path, void *arg),
+                                    void *arg) {
+  if (!path)
+    return NULL;
+
+  rotate_t *r = (rotate_t *)calloc(1, sizeof(rotate_t));
+  if (!r)
+    return NULL;
+  r->path = (char *)malloc(strlen(path) + 1);
+  r->rotated_path = (char *)malloc(strlen(path) + 16);
+  r->gen[0].fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  struct stat st;
+  int ok = r->path && r->rotated_path && r->gen[0].fd >= 0 && fstat(r->gen[0].fd, &st) == 0 &&
+           pthread_mutex_init(&r->lock, NULL) == 0 && pthread_cond_init(&r->wake, &attr) == 0;
+  pthread_condattr_destroy(&attr);
+  if (ok) {
+    strcpy(r->path, path);
+    r->max_bytes = max_bytes;
+    r->max_age_ns = (uint64_t)max_age_s * 1000000000ull;
+    r->on_rotated = on_rotated;
+    r->arg = arg;
+    r->next_index = 1;
+    atomic_init(&r->gen[0].bytes, (size_t)st.st_size); // Appending to an existing file counts
+    atomic_init(&r->gen[0].writers, 0);
+    atomic_init(&r->gen[1].bytes, 0);
+    atomic_init(&r->gen[1].writers, 0);
+    r->gen[0].opened_ns = sink_monotonic_ns();
+    atomic_init(&r->current, &r->gen[0]);
+    atomic_init(&r->failed, 0);
+    r->due = max_bytes && (size_t)st.st_size >= max_bytes;
+    ok = pthread_create(&r->rotator, NULL, rotate_main, r) == 0;
+  }
+
+  if (!ok) {
+    if (r->gen[0].fd >= 0)
+      close(r->gen[0].fd);
+    free(r->path);
+    free(r->rotated_path);
+    free(r);
+    return NULL;
+  }
+
+  r->sink = (display_sink_t){rotate_write, NULL, rotate_close, r};
+  return &r->sink;
+}
+
+#ifndef DISPLAY_DIRECT_ALIGN
+#define DISPLAY_DIRECT_ALIGN 4096 // O_DIRECT buffer, offset and length alignment
+#endif
+
+typedef struct direct_t {
+  display_sink_t sink;
+  int fd;
+  size_t block;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // Writer: a full block was handed over, or stopping
+  pthread_cond_t space; // Producers: the writer is done with the block
+  pthread_t writer;
+  int has_writer;
+
+  char *buf[2]; // buf[active] is being filled, buf[active ^ 1] may be with the writer
+  int active;
+  size_t len;      // Bytes in buf[active]
+  uint64_t offset; // Where buf[active] goes in the file, a multiple of the block size
+  uint64_t busy_offset;
+  int busy, stop, failed; // busy: buf[active ^ 1] is still to be written
+  int copying;            // A record crossing a block boundary is being copied
+
+} direct_t;
+
+static int direct_write_block(direct_t *d, const char *buf, size_t len, uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t w = pwrite(d->fd, buf + done, len - done, (off_t)(offset + done));
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return -1;
+    done += (size_t)w;
+  }
+
+  DISPLAY_PROBE2(flush, d, len);
+  return 0;
+}
+
+static void *direct_writer_main(void *arg) {
+  direct_t *d = (direct_t *)arg;
+
+  pthread_mutex_lock(&d->lock);
+  for (;;) {
+    while (!d->busy && !d->stop)
+      pthread_cond_wait(&d->work, &d->lock);
+    if (!d->busy)
+      break;
+
+    // Producers do not touch buf[active ^ 1] while busy is set
+    const char *buf = d->buf[d->active ^ 1];
+    uint64_t offset = d->busy_offset;
+    pthread_mutex_unlock(&d->lock);
+    int result = direct_write_block(d, buf, d->block, offset);
+    pthread_mutex_lock(&d->lock);
+
+    if (result != 0)
+      d->failed = 1;
+    d->busy = 0;
+    pthread_cond_broadcast(&d->space);
+  }
+  pthread_mutex_unlock(&d->lock);
+
+  return NULL;
+}
+
+/// @brief Hands the full block over, or writes it, and starts the next one. Called locked
+static void direct_next_block(direct_t *d) {
+  while (d->busy)
+    pthread_cond_wait(&d->space, &d->lock);
+
+  if (d->has_writer) {
+    d->busy = 1;
+    d->busy_offset = d->offset;
+    pthread_cond_signal(&d->work);
+  } else if (direct_write_block(d, d->buf[d->active], d->block, d->offset) != 0) {
+    d->failed = 1;
+  }
+
+  d->active ^= 1;
+  d->len = 0;
+  d->offset += d->block;
+}
+
+static int direct_write(void *self, int level, const char *data, size_t len) {
+  direct_t *d = (direct_t *)self;
+  (void)level;
+
+  // Records are a byte stream here: one may end in the next block. The copy of such a record
+  // may wait for the writer, and no other record may get in the middle of it meanwhile
+  pthread_mutex_lock(&d->lock);
+  while (d->copying)
+    pthread_cond_wait(&d->space, &d->lock);
+  int crossing = len >= d->block - d->len;
+  d->copying = crossing;
+  while (len > 0) {
+    size_t n = d->block - d->len < len ? d->block - d->len : len;
+    memcpy(d->buf[d->active] + d->len, data, n);
+    d->len += n;
+    data += n;
+    len -= n;
+    if (d->len == d->block)
+      direct_next_block(d);
+  }
+  if (crossing) {
+    d->copying = 0;
+    pthread_cond_broadcast(&d->space);
+  }
+  int result = d->failed ? -1 : 0;
+  pthread_mutex_unlock(&d->lock);
+
+  return result;
+}
+
+static int direct_flush(void *self) {
+  direct_t *d = (direct_t *)self;
+
+  pthread_mutex_lock(&d->lock);
+  while (d->busy || d->copying)
+    pthread_cond_wait(&d->space, &d->lock);
+
+  // The partial block is written padded and stays in the buffer: it is written again, in full,
+  // once it fills up
+  if (d->len > 0) {
+    size_t padded = (d->len + DISPLAY_DIRECT_ALIGN - 1) / DISPLAY_DIRECT_ALIGN;
+    padded *= DISPLAY_DIRECT_ALIGN;
+    memset(d->buf[d->active] + d->len, 0, padded - d->len);
+    if (direct_write_block(d, d->buf[d->active], padded, d->offset) != 0 ||
+        ftruncate(d->fd, (off_t)(d->offset + d->len)) != 0)
+      d->failed = 1;
+  }
+  int result = d->failed ? -1 : 0;
+  pthread_mutex_unlock(&d->lock);
+
+  return result;
+}
+
+static void direct_free(direct_t *d) {
+  free(d->buf[0]);
+  free(d->buf[1]);
+  free(d);
+}
+
+static int direct_close(void *self) {
+  direct_t *d = (direct_t *)self;
+  int result = direct_flush(d);
+
+  if (d->has_writer) {
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->work);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->writer, NULL);
+  }
+
+  if (close(d->fd) != 0)
+    result = -1;
+  pthread_cond_destroy(&d->work);
+  pthread_cond_destroy(&d->space);
+  pthread_mutex_destroy(&d->lock);
+  direct_free(d);
+  return result;
+}
+
+display_sink_t *display_direct_open(const char *path, size_t block_size, int double_buffer) {
+  if (!path)
+    return NULL;
+  if (block_size == 0)
+    block_size = 1024 * 1024;
+  block_size = (block_size + DISPLAY_DIRECT_ALIGN - 1) / DISPLAY_DIRECT_ALIGN;
+  block_size *= DISPLAY_DIRECT_ALIGN;
+
+  direct_t *d = (direct_t *)calloc(1, sizeof(direct_t));
+  if (!d)
+    return NULL;
+  if (posix_memalign((void **)&d->buf[0], DISPLAY_DIRECT_ALIGN, block_size) != 0 ||
+      posix_memalign((void **)&d->buf[1], DISPLAY_DIRECT_ALIGN, block_size) != 0) {
+    direct_free(d);
+    return NULL;
+  }
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+  d->fd = open(path, flags | O_DIRECT, 0644);
+  if (d->fd == -1 && errno == EINVAL) // Not supported by this filesystem
+#endif
+    d->fd = open(path, flags, 0644);
+  if (d->fd == -1 || pthread_mutex_init(&d->lock, NULL) != 0) {
+    if (d->fd != -1)
+      close(d->fd);
+    direct_free(d);
+    return NULL;
+  }
+  pthread_cond_init(&d->work, NULL);
+  pthread_cond_init(&d->space, NULL);
+
+  d->sink = (display_sink_t){direct_write, direct_flush, direct_close, d};
+  d->block = block_size;
+  if (double_buffer && pthread_create(&d->writer, NULL, direct_writer_main, d) == 0)
+    d->has_writer = 1;
+
+  return &d->sink;
+}
+
+// LZ4 frame format, see https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+#define LZ4_MAGIC 0x184D2204u
+#define LZ4_HASH_LOG 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // A block ends with at least this many literals
+#define LZ4_MF_LIMIT 12     // and no match starts in its last 12 bytes
+#define LZ4_MAX_OFFSET 65535
+
+static uint32_t lz4_rotl(uint32_t v, int r) { return v << r | v >> (32 - r); }
+
+/// @brief XXH32 of `len` bytes, for the frame header and block checksums
+static uint32_t lz4_xxh32(const uint8_t *p, size_t len, uint32_t seed) {
+  const uint32_t p1 = 2654435761u, p2 = 2246822519u, p3 = 3266489917u, p4 = 668265263u,
+                 p5 = 374761393u;
+  const uint8_t *end = p + len;
+  uint32_t h;
+
+  if (len >= 16) {
+    uint32_t v[4] = {seed + p1 + p2, seed + p2, seed, seed - p1};
+    for (; end - p >= 16; p += 16) {
+      for (int i = 0; i < 4; i++)
+        v[i] = lz4_rotl(v[i] + load_le32(p + 4 * i) * p2, 13) * p1;
+    }
+    h = lz4_rotl(v[0], 1) + lz4_rotl(v[1], 7) + lz4_rotl(v[2], 12) + lz4_rotl(v[3], 18);
+  } else {
+    h = seed + p5;
+  }
+
+  h += (uint32_t)len;
+  for (; end - p >= 4; p += 4)
+    h = lz4_rotl(h + load_le32(p) * p3, 17) * p4;
+  for (; p < end; p++)
+    h = lz4_rotl(h + *p * p5, 11) * p1;
+
+  h ^= h >> 15;
+  h *= p2;
+  h ^= h >> 13;
+  h *= p3;
+  h ^= h >> 16;
+  return h;
+}
+
+static uint8_t *lz4_write_length(uint8_t *op, size_t len) {
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/// @brief Compresses one independent block greedily, in the LZ4 block format. `dst` holds at
+/// least lz4_bound(n) bytes
+/// @return The compressed size
+static size_t lz4_compress_block(const uint8_t *src, size_t n, uint8_t *dst, uint32_t *table) {
+  const uint8_t *ip = src, *anchor = src, *end = src + n;
+  uint8_t *op = dst;
+
+  if (n > LZ4_MF_LIMIT) {
+    const uint8_t *mf_limit = end - LZ4_MF_LIMIT, *match_limit = end - LZ4_LAST_LITERALS;
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG); // Every entry is a candidate at src
+    unsigned misses = 0;
+
+    for (ip++; ip < mf_limit;) {
+      uint32_t seq = load_le32(ip);
+      uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_LOG);
+      const uint8_t *ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || load_le32(ref) != seq) {
+        ip += 1 + (misses++ >> 6); // Skip faster through data that does not compress
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      size_t match = LZ4_MIN_MATCH;
+      while (ip + match < match_limit && ip[match] == ref[match])
+        match++;
+
+      size_t literals = (size_t)(ip - anchor);
+      uint8_t *token = op++;
+      *token = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+      if (literals >= 15)
+        op = lz4_write_length(op, literals - 15);
+      memcpy(op, anchor, literals);
+      op += literals;
+
+      uint16_t offset = (uint16_t)(ip - ref);
+      *op++ = (uint8_t)offset;
+      *op++ = (uint8_t)(offset >> 8);
+      size_t extra = match - LZ4_MIN_MATCH;
+      *token |= (uint8_t)(extra >= 15 ? 15 : extra);
+      if (extra >= 15)
+        op = lz4_write_length(op, extra - 15);
+
+      ip += match;
+      anchor = ip;
+    }
+  }
+
+  size_t literals = (size_t)(end - anchor);
+  *op++ = (uint8_t)((literals >= 15 ? 15 : literals) << 4);
+  if (literals >= 15)
+    op = lz4_write_length(op, literals - 15);
+  memcpy(op, anchor, literals);
+  return (size_t)(op + literals - dst);
+}
+
+static size_t lz4_bound(size_t n) { return n + n / 255 + 16; }
+
+typedef struct lz4_sink_t {
+  display_sink_t sink;
+  int fd;
+  size_t block;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;  // Compressor: a block was handed over, or stopping
+  pthread_cond_t space; // Producers and flush: the compressor is done with the block
+  pthread_t compressor;
+
+  char *buf[2]; // buf[active] is being filled, buf[active ^ 1] may be with the compressor
+  int active;
+  size_t len, busy_len;   // Bytes in buf[active] and in the block handed over
+  int busy, stop, failed; // busy: buf[active ^ 1] is still to be compressed
+  int copying;            // A record crossing a block boundary is being copied
+
+  uint8_t *out; // Compressor only: block size, data and checksum
+  uint32_t table[1 << LZ4_HASH_LOG];
+
+} lz4_sink_t;
+
+/// @brief Compresses a block and writes it with its size and checksum. Compressor thread only
+static int lz4_write_block(lz4_sink_t *z, const uint8_t *data, size_t len) {
+  size_t size = lz4_compress_block(data, len, z->out + 4, z->table);
+  uint32_t header = (uint32_t)size;
+  if (size >= len) { // Stored as is, flagged by the high bit
+    memcpy(z->out + 4, data, len);
+    size = len;
+    header = (uint32_t)len | 0x80000000u;
+  }
+
+  store_le32(z->out, header);
+  store_le32(z->out + 4 + size, lz4_xxh32(z->out + 4, size, 0));
+  struct iovec iov = {z->out, size + 8};
+  DISPLAY_PROBE2(flush, z, iov.iov_len);
+  return writev_all(z->fd, &iov, 1);
+}
+
+static void *lz4_compress_main(void *arg) {
+  lz4_sink_t *z = (lz4_sink_t *)arg;
+
+  pthread_mutex_lock(&z->lock);
+  for (;;) {
+    while (!z->busy && !z->stop)
+      pthread_cond_wait(&z->work, &z->lock);
+    if (!z->busy)
+      break;
+
+    const uint8_t *data = (const uint8_t *)z->buf[z->active ^ 1];
+    size_t len = z->busy_len;
+    pthread_mutex_unlock(&z->lock);
+    int result = lz4_write_block(z, data, len);
+    pthread_mutex_lock(&z->lock);
+
+    if (result != 0)
+      z->failed = 1;
+    z->busy = 0;
+    pthread_cond_broadcast(&z->space);
+  }
+  pthread_mutex_unlock(&z->lock);
+
+  return NULL;
+}
+
+/// @brief Hands the current block to the compressor and starts the next one. Called locked
+static void lz4_next_block(lz4_sink_t *z) {
+  while (z->busy)
+    pthread_cond_wait(&z->space, &z->lock);
+
+  z->busy = 1;
+  z->busy_len = z->len;
+  pthread_cond_signal(&z->work);
+  z->active ^= 1;
+  z->len = 0;
+}
+
+static int lz4_write(void *self, int level, const char *data, size_t len) {
+  lz4_sink_t *z = (lz4_sink_t *)self;
+  (void)level;
+
+  // As in direct_write, a record may end in the next block and is copied in one go
+  pthread_mutex_lock(&z->lock);
+  while (z->copying)
+    pthread_cond_wait(&z->space, &z->lock);
+  int crossing = len >= z->block - z->len;
+  z->copying = crossing;
+  while (len > 0) {
+    size_t n = z->block - z->len < len ? z->block - z->len : len;
+    memcpy(z->buf[z->active] + z->len, data, n);
+    z->len += n;
+    data += n;
+    len -= n;
+    if (z->len == z->block)
+      lz4_next_block(z);
+  }
+  if (crossing) {
+    z->copying = 0;
+    pthread_cond_broadcast(&z->space);
+  }
+  int result = z->failed ? -1 : 0;
+  pthread_mutex_unlock(&z->lock);
+
+  return result;
+}
+
+static int lz4_flush(void *self) {
+  lz4_sink_t *z = (lz4_sink_t *)self;
+
+  pthread_mutex_lock(&z->lock);
+  while (z->copying)
+    pthread_cond_wait(&z->space, &z->lock);
+  if (z->len > 0)
+    lz4_next_block(z);
+  while (z->busy)
+    pthread_cond_wait(&z->space, &z->lock);
+  int result = z->failed ? -1 : 0;
+  pthread_mutex_unlock(&z->lock);
+
+  return result;
+}
+
+static void lz4_free(lz4_sink_t *z) {
+  free(z->buf[0]);
+  free(z->buf[1]);
+  free(z->out);
+  free(z);
+}
+
+static int lz4_close(void *self) {
+  lz4_sink_t *z = (lz4_sink_t *)self;
+  int result = lz4_flush(z);
+
+  pthread_mutex_lock(&z->lock);
+  z->stop = 1;
+  pthread_cond_broadcast(&z->work);
+  pthread_mutex_unlock(&z->lock);
+  pthread_join(z->compressor, NULL);
+
+  uint8_t end_mark[4] = {0, 0, 0, 0};
+  struct iovec iov = {end_mark, sizeof(end_mark)};
+  if (writev_all(z->fd, &iov, 1) != 0)
+    result = -1;
+
+  pthread_cond_destroy(&z->work);
+  pthread_cond_destroy(&z->space);
+  pthread_mutex_destroy(&z->lock);
+  lz4_free(z);
+  return result;
+}
+
+display_sink_t *display_lz4_open(int fd, size_t block_size) {
+  if (fd < 0)
+    return NULL;
+
+  // Block maximum size codes of the frame descriptor: 4 to 7 for 64 KiB to 4 MiB
+  unsigned code = 4;
+  while (code < 7 && block_size > (size_t)1 << (8 + 2 * code))
+    code++;
+  block_size = (size_t)1 << (8 + 2 * code);
+
+  lz4_sink_t *z = (lz4_sink_t *)calloc(1, sizeof(lz4_sink_t));
+  if (!z)
+    return NULL;
+  z->buf[0] = (char *)malloc(block_size);
+  z->buf[1] = (char *)malloc(block_size);
+  z->out = (uint8_t *)malloc(lz4_bound(block_size) + 8);
+  if (!z->buf[0] || !z->buf[1] || !z->out || pthread_mutex_init(&z->lock, NULL) != 0) {
+    lz4_free(z);
+    return NULL;
+  }
+  pthread_cond_init(&z->work, NULL);
+  pthread_cond_init(&z->space, NULL);
+
+  // Version 01, independent blocks, block checksums; no content size, checksum or dictionary
+  uint8_t header[7];
+  store_le32(header, LZ4_MAGIC);
+  header[4] = 0x70;
+  header[5] = (uint8_t)(code << 4);
+  header[6] = (uint8_t)(lz4_xxh32(header + 4, 2, 0) >> 8);
+  struct iovec iov = {header, sizeof(header)};
+  if (writev_all(fd, &iov, 1) != 0 ||
+      pthread_create(&z->compressor, NULL, lz4_compress_main, z) != 0) {
+    pthread_cond_destroy(&z->work);
+    pthread_cond_destroy(&z->space);
+    pthread_mutex_destroy(&z->lock);
+    lz4_free(z);
+    return NULL;
+  }
+
+  z->sink = (display_sink_t){lz4_write, lz4_flush, lz4_close, z};
+  z->fd = fd;
+  z->block = block_size;
+  return &z->sink;
+}
+
+typedef struct uring_buf_t {
+  char *data;
+  size_t len;      // Bytes filled
+  size_t done;     // Bytes already written, when a write came back short
+  uint64_t offset; // Where data goes in the file, for seekable fds
+} uring_buf_t;
+
+typedef struct uring_t {
+  buffered_sink_t base;
+  int fd;
+  int stream; // Pipe, socket or O_APPEND: one write in flight so that records stay in order
+  int error;
+  uint64_t offset; // Next file offset, for seekable fds
+  size_t buf_size;
+
+  uring_buf_t *bufs;
+  unsigned depth;
+  int fill;           // Buffer being filled, -1 if none
+  unsigned *free_buf; // Stack of buffers ready to be filled
+  unsigned free_len;
+  unsigned *ready; // Full buffers waiting for a submission slot, from ready_head, in order
+  unsigned ready_head, ready_len;
+  unsigned inflight, max_inflight;
+
+  int ring_fd; // -1: plain writes
+#ifdef DISPLAY_HAS_URING
+  int fixed; // Buffers registered, IORING_OP_WRITE_FIXED
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  struct io_uring_sqe *sqes;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+#endif
+
+} uring_t;
+
+#ifdef DISPLAY_HAS_URING
+/// @brief Creates the ring and registers the buffers
+/// @return 0 on success, -1 if io_uring is not available
+static int uring_ring_setup(uring_t *u) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int ring_fd = (int)syscall(__NR_io_uring_setup, u->depth, &p);
+  if (ring_fd < 0)
+    return -1;
+
+  u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cq_ring_size > u->sq_ring_size)
+    u->sq_ring_size = u->cq_ring_size;
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQ_RING);
+  u->cq_ring = u->sq_ring;
+  if (u->sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+    if (u->sqes != MAP_FAILED)
+      munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+      munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring != MAP_FAILED)
+      munmap(u->sq_ring, u->sq_ring_size);
+    close(ring_fd);
+    return -1;
+  }
+
+  char *sq = (char *)u->sq_ring, *cq = (char *)u->cq_ring;
+  u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  u->sq_array = (unsigned *)(sq + p.sq_off.array);
+  u->cq_head = (unsigned *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  // Registering pins the buffers, which RLIMIT_MEMLOCK may refuse: then use plain IORING_OP_WRITE
+  struct iovec *iov = (struct iovec *)malloc(u->depth * sizeof(struct iovec));
+  if (iov) {
+    for (unsigned i = 0; i < u->depth; i++)
+      iov[i] = (struct iovec){u->bufs[i].data, u->buf_size};
+    u->fixed =
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, u->depth) == 0;
+    free(iov);
+  }
+
+  u->ring_fd = ring_fd;
+  return 0;
+}
+
+static void uring_ring_teardown(uring_t *u) {
+  munmap(u->sqes, u->sqes_size);
+  if (u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring, u->cq_ring_size);
+  munmap(u->sq_ring, u->sq_ring_size);
+  close(u->ring_fd); // Unregisters the buffers
+}
+
+/// @brief Recycles completed buffers, resubmitting the rest of short writes. Called locked
+static void uring_reap(uring_t *u) {
+  unsigned head = *u->cq_head;
+  unsigned tail = atomic_load_explicit((_Atomic unsigned *)u->cq_tail, memory_order_acquire);
+
+  for (; head != tail; head++) {
+    const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    unsigned i = (unsigned)cqe->user_data;
+    uring_buf_t *b = &u->bufs[i];
+    u->inflight--;
+
+    if (cqe->res > 0 && b->done + (size_t)cqe->res < b->len) {
+      // Short write: the rest goes first, ahead of the buffers still waiting
+      b->done += (size_t)cqe->res;
+      u->ready_head = (u->ready_head + u->depth - 1) % u->depth;
+      u->ready[u->ready_head] = i;
+      u->ready_len++;
+      continue;
+    }
+
+    if (cqe->res > 0)
+      DISPLAY_PROBE2(flush, u, b->len);
+    else
+      u->error = 1;
+    b->len = b->done = 0;
+    u->free_buf[u->free_len++] = i;
+  }
+
+  atomic_store_explicit((_Atomic unsigned *)u->cq_head, head, memory_order_release);
+}
+
+/// @brief Waits for at least one write to complete. Called locked
+/// @return 0 on success, -1 on failure
+static int uring_wait(uring_t *u) {
+  // to_submit also retries entries a failed io_uring_enter left in the ring, the kernel caps it
+  while (syscall(__NR_io_uring_enter, u->ring_fd, u->depth, 1, IORING_ENTER_GETEVENTS, NULL, 0) <
+         0) {
+    if (errno != EINTR) {
+      u->error = 1;
+      return -1;
+    }
+  }
+
+  uring_reap(u);
+  return 0;
+}
+#endif
+
+/// @brief Writes one buffer with plain writes, when io_uring is not available. Called locked
+static void uring_write_sync(uring_t *u, uring_buf_t *b) {
+  while (b->done < b->len) {
+    ssize_t w = u->stream ? write(u->fd, b->data + b->done, b->len - b->done)
+                          : pwrite(u->fd, b->data + b->done, b->len - b->done,
+                                   (off_t)(b->offset + b->done));
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w <= 0) {
+      u->error = 1;
+      break;
+    }
+    b->done += (size_t)w;
+  }
+
+  DISPLAY_PROBE2(flush, u, b->done);
+  b->len = b->done = 0;
+}
+
+/// @brief Submits waiting buffers while there are free submission slots. Called locked
+static void uring_submit(uring_t *u) {
+#ifdef DISPLAY_HAS_URING
+  unsigned count = 0;
+#endif
+
+  while (u->ready_len > 0 && u->inflight < u->max_inflight) {
+    unsigned i = u->ready[u->ready_head];
+    u->ready_head = (u->ready_head + 1) % u->depth;
+    u->ready_len--;
+    uring_buf_t *b = &u->bufs[i];
+
+    if (u->ring_fd == -1) {
+      uring_write_sync(u, b);
+      u->free_buf[u->free_len++] = i;
+      continue;
+    }
+
+#ifdef DISPLAY_HAS_URING
+    unsigned tail = *u->sq_tail + count;
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = u->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(b->data + b->done);
+    sqe->len = (uint32_t)(b->len - b->done);
+    sqe->off = u->stream ? (uint64_t)-1 : b->offset + b->done; // -1: the fd's own position
+    sqe->buf_index = (uint16_t)i;
+    sqe->user_data = i;
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    u->inflight++;
+    count++;
+#endif
+  }
+
+#ifdef DISPLAY_HAS_URING
+  if (count == 0)
+    return;
+  atomic_store_explicit((_Atomic unsigned *)u->sq_tail, *u->sq_tail + count,
+                        memory_order_release);
+  while (syscall(__NR_io_uring_enter, u->ring_fd, count, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN) {
+      u->error = 1;
+      break;
+    }
+  }
+#endif
+}
+
+/// @brief Queues the buffer being filled for writing, without waiting. Called locked
+static int uring_flush_locked(buffered_sink_t *base) {
+  uring_t *u = (uring_t *)base;
+  if (u->fill != -1 && u->bufs[u->fill].len > 0) {
+    uring_buf_t *b = &u->bufs[u->fill];
+    b->offset = u->offset;
+    u->offset += b->len;
+    u->ready[(u->ready_head + u->ready_len) % u->depth] = (unsigned)u->fill;
+    u->ready_len++;
+    u->fill = -1;
+  }
+  u->base.pending = 0;
+
+#ifdef DISPLAY_HAS_URING
+  if (u->ring_fd != -1)
+    uring_reap(u);
+#endif
+  uring_submit(u);
+  return u->error ? -1 : 0;
+}
+
+/// @brief Waits until every queued buffer is written. Called locked
+static int uring_drain(uring_t *u) {
+  uring_flush_locked(&u->base);
+#ifdef DISPLAY_HAS_URING
+  while (u->ring_fd != -1 && (u->inflight > 0 || u->ready_len > 0)) {
+    if (uring_wait(u) == -1)
+      return -1;
+    uring_submit(u);
+  }
+#endif
+
+  return u->error ? -1 : 0;
+}
+
+static int uring_write(void *self, int level, const char *data, size_t len) {
+  uring_t *u = (uring_t *)self;
+  int result = 0;
+
+  pthread_mutex_lock(&u->base.lock);
+  if (len > u->buf_size) {
+    // Too big for a buffer: written in place once everything before it is
+    if (uring_drain(u) == 0) {
+      uring_buf_t big = {(char *)data, len, 0, u->offset};
+      uring_write_sync(u, &big);
+      u->offset += len;
+    }
+    result = u->error ? -1 : 0;
+    pthread_mutex_unlock(&u->base.lock);
+    return result;
+  }
+
+  if (u->fill != -1 && len > u->buf_size - u->bufs[u->fill].len)
+    result = uring_flush_locked(&u->base);
+  if (u->fill == -1) {
+#ifdef DISPLAY_HAS_URING
+    // Every buffer is queued or in flight: wait for the kernel to give one back
+    while (u->free_len == 0 && u->ring_fd != -1 && uring_wait(u) == 0)
+      uring_submit(u);
+#endif
+    if (u->free_len == 0) {
+      DISPLAY_PROBE2(drop, u, len);
+      pthread_mutex_unlock(&u->base.lock);
+      return -1;
+    }
+    u->fill = (int)u->free_buf[--u->free_len];
+  }
+
+  uring_buf_t *b = &u->bufs[u->fill];
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  if (policy_on_write(&u->base, level, data, len))
+    result = uring_flush_locked(&u->base);
+  pthread_mutex_unlock(&u->base.lock);
+
+  return result;
+}
+
+static int uring_flush(void *self) {
+  uring_t *u = (uring_t *)self;
+
+  pthread_mutex_lock(&u->base.lock);
+  int result = uring_drain(u);
+  pthread_mutex_unlock(&u->base.lock);
+
+  return result;
+}
+
+int display_uring_active(display_sink_t *sink) {
+  return sink && ((uring_t *)sink->self)->ring_fd != -1;
+}
+
+static void uring_free(uring_t *u) {
+  for (unsigned i = 0; i < u->depth; i++)
+    free(u->bufs[i].data);
+  free(u->bufs);
+  free(u->free_buf);
+  free(u->ready);
+  free(u);
+}
+
+static int uring_close(void *self) {
+  uring_t *u = (uring_t *)self;
+  int result = uring_flush(u);
+  if (policy_detach(&u->base) == -1)
+    result = -1;
+
+  // The writes used explicit offsets: leave the fd where a plain write would have
+  if (!u->stream)
+    lseek(u->fd, (off_t)u->offset, SEEK_SET);
+#ifdef DISPLAY_HAS_URING
+  if (u->ring_fd != -1)
+    uring_ring_teardown(u);
+#endif
+  uring_free(u);
+  return result;
+}
+
+display_sink_t *display_uring_open(int fd, size_t buffer_size, unsigned queue_depth,
+                                   const display_flush_policy_t *policy) {
+  int flags = fd < 0 ? -1 : fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return NULL;
+  if (buffer_size == 0)
+    buffer_size = 64 * 1024;
+  if (queue_depth < 2)
+    queue_depth = 8;
+
+  uring_t *u = (uring_t *)calloc(1, sizeof(uring_t));
+  if (!u)
+    return NULL;
+  u->depth = queue_depth;
+  u->bufs = (uring_buf_t *)calloc(queue_depth, sizeof(uring_buf_t));
+  u->free_buf = (unsigned *)malloc(queue_depth * sizeof(unsigned));
+  u->ready = (unsigned *)malloc(queue_depth * sizeof(unsigned));
+  int ok = u->bufs && u->free_buf && u->ready;
+  for (unsigned i = 0; ok && i < queue_depth; i++) {
+    // Page aligned, so that registering them pins as few pages as possible
+    if (posix_memalign((void **)&u->bufs[i].data, 4096, buffer_size) != 0)
+      ok = 0;
+    else
+      u->free_buf[u->free_len++] = queue_depth - 1 - i;
+  }
+  if (!ok || policy_attach(&u->base, policy, fd) == -1) {
+    uring_free(u);
+    return NULL;
+  }
+
+  u->base.sink = (display_sink_t){uring_write, uring_flush, uring_close, u};
+  u->base.flush_locked = uring_flush_locked;
+  u->fd = fd;
+  u->fill = -1;
+  u->buf_size = buffer_size;
+
+  off_t pos = lseek(fd, 0, SEEK_CUR);
+  u->stream = pos == -1 || (flags & O_APPEND);
+  u->offset = pos == -1 ? 0 : (uint64_t)pos;
+  u->max_inflight = u->stream ? 1 : queue_depth;
+
+  u->ring_fd = -1;
+#ifdef DISPLAY_HAS_URING
+  uring_ring_setup(u);
+#endif
+
+  return &u->base.sink;
+}
+
+#define DISPLAY_SHARD_MAGIC "DSHD0001" // First 8 bytes of a shard, then stamped records
+
+// One thread's file of a sharded sink
+typedef struct shard_t {
+  struct shard_sink_t *owner;
+  display_sink_t *buffer; // display_fdbuf_open over fd
+  int fd;
+  int closed; // Its thread exited: buffer and fd are closed, error tells how that went
+  int error;
+  struct shard_t *next;
+
+} shard_t;
+
+typedef struct shard_sink_t {
+  display_sink_t sink;
+  char *path;
+  size_t capacity;
+  int stamp;
+  pthread_key_t key; // The calling thread's shard_t
+
+  pthread_mutex_t lock; // Only taken to add a shard
+  shard_t *shards;
+  unsigned count;
+
+  _Alignas(64) _Atomic uint64_t seq; // DISPLAY_SHARD_SEQ, on a cache line of its own
+
+} shard_sink_t;
+
+/// @brief Closes the shard of an exiting thread, so that threads coming and going do not
+/// accumulate buffers and fds until display_sink_close
+static void shard_thread_exit(void *arg) {
+  shard_t *shard = (shard_t *)arg;
+  shard_sink_t *h = shard->owner;
+
+  pthread_mutex_lock(&h->lock);
+  if (display_sink_close(shard->buffer) == -1 || close(shard->fd) != 0)
+    shard->error = 1;
+  shard->buffer = NULL;
+  shard->fd = -1;
+  shard->closed = 1;
+  pthread_mutex_unlock(&h->lock);
+}
+
+static shard_t *shard_create(shard_sink_t *h) {
+  shard_t *shard = (shard_t *)calloc(1, sizeof(shard_t));
+  if (!shard)
+    return NULL;
+
+  pthread_mutex_lock(&h->lock);
+  char *path = (char *)malloc(strlen(h->path) + 16);
+  if (path)
+    sprintf(path, "%s.%u", h->path, h->count);
+  shard->fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+  free(path);
+
+  struct iovec iov = {(void *)DISPLAY_SHARD_MAGIC, 8};
+  display_flush_policy_t policy = {DISPLAY_FLUSH_EXIT, 0, 0, DISPLAY_LEVEL_NONE};
+  if (shard->fd >= 0 && writev_all(shard->fd, &iov, 1) == 0)
+    shard->buffer = display_fdbuf_open(shard->fd, h->capacity, &policy);
+  if (!shard->buffer) {
+    pthread_mutex_unlock(&h->lock);
+    if (shard->fd >= 0)
+      close(shard->fd);
+    free(shard);
+    return NULL;
+  }
+
+  shard->owner = h;
+  shard->next = h->shards;
+  h->shards = shard;
+  h->count++;
+  pthread_mutex_unlock(&h->lock);
+
+  pthread_setspecific(h->key, shard);
+  return shard;
+}
+
+static int shard_write(void *self, int level, const char *data, size_t len) {
+  shard_sink_t *h = (shard_sink_t *)self;
+  if (len > UINT32_MAX)
+    return -1;
+
+  shard_t *shard = (shard_t *)pthread_getspecific(h->key);
+  if (!shard && !(shard = shard_create(h)))
+    return -1;
+
+  uint64_t stamp;
+  if (h->stamp == DISPLAY_SHARD_SEQ) {
+    stamp = atomic_fetch_add_explicit(&h->seq, 1, memory_order_relaxed);
+  } else {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stamp = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+  }
+
+  // Only this thread writes to the shard, the header and the record cannot be separated
+  uint8_t header[12];
+  store_le64(header, stamp);
+  store_le32(header + 8, (uint32_t)len);
+  display_sink_t *buffer = shard->buffer;
+  if (buffer->write_fn(buffer->self, level, (const char *)header, sizeof(header)) == -1)
+    return -1;
+  return buffer->write_fn(buffer->self, level, data, len);
+}
+
+static int shard_flush(void *self) {
+  shard_sink_t *h = (shard_sink_t *)self;
+  int result = 0;
+
+  pthread_mutex_lock(&h->lock);
+  for (shard_t *shard = h->shards; shard; shard = shard->next) {
+    if (!shard->closed && display_sink_flush(shard->buffer) == -1)
+      result = -1;
+  }
+  pthread_mutex_unlock(&h->lock);
+
+  return result;
+}
+
+static int shard_close(void *self) {
+  shard_sink_t *h = (shard_sink_t *)self;
+  int result = 0;
+
+  // Stops destructors that have not started yet, the lock waits for those running
+  pthread_key_delete(h->key);
+  pthread_mutex_lock(&h->lock);
+  for (shard_t *shard = h->shards, *next; shard; shard = next) {
+    next = shard->next;
+    if (shard->closed ? shard->error
+                      : (display_sink_close(shard->buffer) == -1 || close(shard->fd) != 0))
+      result = -1;
+    free(shard);
+  }
+  h->shards = NULL;
+  pthread_mutex_unlock(&h->lock);
+
+  pthread_mutex_destroy(&h->lock);
+  free(h->path);
+  free(h);
+  return result;
+}
+
+display_sink_t *display_shard_open(const char *path, size_t capacity, int stamp) {
+  if (!path || (stamp != DISPLAY_SHARD_CLOCK && stamp != DISPLAY_SHARD_SEQ))
+    return NULL;
+
+  shard_sink_t *h;
+  if (posix_memalign((void **)&h, 64, sizeof(shard_sink_t)) != 0) // For the _Alignas(64) counter
+    return NULL;
+  memset(h, 0, sizeof(shard_sink_t));
+  h->path = (char *)malloc(strlen(path) + 1);
+  if (!h->path || pthread_mutex_init(&h->lock, NULL) != 0) {
+    free(h->path);
+    free(h);
+    return NULL;
+  }
+  if (pthread_key_create(&h->key, shard_thread_exit) != 0) {
+    pthread_mutex_destroy(&h->lock);
+    free(h->path);
+    free(h);
+    return NULL;
+  }
+
+  h->sink = (display_sink_t){shard_write, shard_flush, shard_close, h};
+  strcpy(h->path, path);
+  h->capacity = capacity;
+  h->stamp = stamp;
+  return &h->sink;
+}
+
+typedef struct reorder_slot_t {
+  char *data;
+  size_t len, cap;
+  int level;
+  int full;
+
+} reorder_slot_t;
+
+typedef struct reorder_t {
+  display_sink_t sink;
+  display_sink_t *inner;
+  size_t window;
+
+  pthread_mutex_t lock;
+  pthread_cond_t space; // Producers too far ahead: `next` moved
+  reorder_slot_t *slots; // Record `seq` is in slots[seq % window]
+  uint64_t next;         // Sequence number of the next record to write
+  int emitting;          // A thread is writing a run, it writes those that follow as well
+
+  char *run; // The run being written, only used by the emitting thread
+  size_t run_cap;
+
+} reorder_t;
+
+// The sequence number display_reorder_print passes to reorder_write through sink_vprint
+static __thread uint64_t reorder_seq;
+static __thread int reorder_has_seq;
+
+/// @brief Writes every contiguous record from `next` on, then leaves. Called locked, with
+/// emitting set
+static int reorder_emit(reorder_t *x) {
+  int result = 0;
+
+  while (x->slots[x->next % x->window].full) {
+    size_t len = 0;
+    int level = DISPLAY_LEVEL_NONE;
+    uint64_t seq = x->next;
+    for (reorder_slot_t *slot; (slot = &x->slots[seq % x->window])->full; seq++) {
+      if (len + slot->len > x->run_cap) {
+        size_t cap = x->run_cap ? x->run_cap : 64 * 1024;
+        while (cap < len + slot->len)
+          cap *= 2;
+        char *run = (char *)realloc(x->run, cap);
+        if (!run)
+          break;
+        x->run = run;
+        x->run_cap = cap;
+      }
+
+      memcpy(x->run + len, slot->data, slot->len);
+      len += slot->len;
+      if (slot->level > level)
+        level = slot->level;
+      slot->full = 0;
+    }
+    if (seq == x->next) {
+      // Could not even grow the run for one record: write it from its slot instead. The slot
+      // stays full and `next` unchanged until it is written, so no producer can refill it
+      reorder_slot_t *slot = &x->slots[seq % x->window];
+      pthread_mutex_unlock(&x->lock);
+      if (slot->len > 0 && x->inner->write_fn(x->inner->self, slot->level, slot->data,
+                                               slot->len) == -1)
+        result = -1;
+      pthread_mutex_lock(&x->lock);
+      slot->full = 0;
+      x->next = seq + 1;
+      pthread_cond_broadcast(&x->space);
+      continue;
+    }
+
+    x->next = seq;
+    pthread_cond_broadcast(&x->space);
+    pthread_mutex_unlock(&x->lock);
+    if (len > 0 && x->inner->write_fn(x->inner->self, level, x->run, len) == -1)
+      result = -1;
+    pthread_mutex_lock(&x->lock);
+  }
+
+  return result;
+}
+
+static int reorder_put(reorder_t *x, uint64_t seq, int level, const char *data, size_t len) {
+  pthread_mutex_lock(&x->lock);
+  while (seq >= x->next + x->window)
+    pthread_cond_wait(&x->space, &x->lock);
+
+  reorder_slot_t *slot = &x->slots[seq % x->window];
+  if (seq < x->next || slot->full) {
+    pthread_mutex_unlock(&x->lock);
+    return -1;
+  }
+  if (len > slot->cap) {
+    char *data_copy = (char *)realloc(slot->data, len);
+    if (!data_copy) {
+      pthread_mutex_unlock(&x->lock);
+      return -1;
+    }
+    slot->data = data_copy;
+    slot->cap = len;
+  }
+
+  memcpy(slot->data, data, len);
+  slot->len = len;
+  slot->level = level;
+  slot->full = 1;
+
+  int result = 0;
+  if (seq == x->next && !x->emitting) {
+    x->emitting = 1;
+    result = reorder_emit(x);
+    x->emitting = 0;
+  }
+  pthread_mutex_unlock(&x->lock);
+
+  return result;
+}
+
+static int reorder_write(void *self, int level, const char *data, size_t len) {
+  if (!reorder_has_seq) // Not written through display_reorder_*: no sequence number
+    return -1;
+
+  reorder_has_seq = 0;
+  return reorder_put((reorder_t *)self, reorder_seq, level, data, len);
+}
+
+static int reorder_flush(void *self) { return display_sink_flush(((reorder_t *)self)->inner); }
+
+static int reorder_close(void *self) {
+  reorder_t *x = (reorder_t *)self;
+  int result = 0;
+
+  // Whatever is left follows a record that never came: write it in order, gaps skipped
+  for (size_t i = 0; i < x->window; i++, x->next++) {
+    reorder_slot_t *slot = &x->slots[x->next % x->window];
+    if (!slot->full)
+      continue;
+    result = -1;
+    if (slot->len > 0)
+      x->inner->write_fn(x->inner->self, slot->level, slot->data, slot->len);
+  }
+  if (display_sink_close(x->inner) == -1)
+    result = -1;
+
+  for (size_t i = 0; i < x->window; i++)
+    free(x->slots[i].data);
+  free(x->slots);
+  free(x->run);
+  pthread_cond_destroy(&x->space);
+  pthread_mutex_destroy(&x->lock);
+  free(x);
+  return result;
+}
+
+display_sink_t *display_reorder_open(display_sink_t *inner, size_t window) {
+  if (!inner)
+    return NULL;
+  if (window == 0)
+    window = 1024;
+
+  reorder_t *x = (reorder_t *)calloc(1, sizeof(reorder_t));
+  if (!x)
+    return NULL;
+  x->slots = (reorder_slot_t *)calloc(window, sizeof(reorder_slot_t));
+  if (!x->slots || pthread_mutex_init(&x->lock, NULL) != 0) {
+    free(x->slots);
+    free(x);
+    return NULL;
+  }
+  pthread_cond_init(&x->space, NULL);
+
+  x->sink = (display_sink_t){reorder_write, reorder_flush, reorder_close, x};
+  x->inner = inner;
+  x->window = window;
+  return &x->sink;
+}
+
+static int reorder_vprint(display_sink_t *sink, uint64_t seq, const char *format, va_list args,
+                          int newline) {
+  reorder_seq = seq;
+  reorder_has_seq = 1;
+  int result = sink_vprint(sink, DISPLAY_LEVEL_NONE, format, args, newline, 0);
+
+  // An empty or failed record never reached reorder_write: it still takes its place, otherwise
+  // the records after it would wait forever
+  if (reorder_has_seq) {
+    reorder_has_seq = 0;
+    if (reorder_put((reorder_t *)sink->self, seq, DISPLAY_LEVEL_NONE, "", 0) == -1)
+      result = -1;
+  }
+
+  return result;
+}
+
+int display_reorder_print(display_sink_t *sink, uint64_t seq, const char *__restrict format,
+                          ...) {
+  if (!sink || !format)
+    return -1;
+
+  va_list args;
+  va_start(args, format);
+  int result = reorder_vprint(sink, seq, format, args, 0);
+  va_end(args);
+
+  return result;
+}
+
+int display_reorder_println(display_sink_t *sink, uint64_t seq, const char *__restrict format,
+                            ...) {
+  if (!sink || !format)
+    return -1;
+
+  va_list args;
+  va_start(args, format);
+  int result = reorder_vprint(sink, seq, format, args, 1);
+  va_end(args);
+
+  return result;
+}
+
+int display_reorder_write(display_sink_t *sink, uint64_t seq, const char *data, size_t len) {
+  if (!sink || (!data && len > 0))
+    return -1;
+
+  return reorder_put((reorder_t *)sink->self, seq, DISPLAY_LEVEL_NONE, data, len);
+}
+
+#define DISPLAY_INDEX_MAGIC "DIDX0001" // First 8 bytes of an index, then 24-byte entries
+
+typedef struct indexed_t {
+  display_sink_t sink;
+  display_sink_t *inner;
+  int index_fd;
+  unsigned every_records;
+  size_t every_bytes;
+
+  pthread_mutex_t lock; // Offsets are only right if records reach `inner` in the order counted
+  uint64_t offset, seq;
+  uint64_t last_offset, last_seq; // Of the last entry
+  int has_entry;
+  int error; // Sticky: writing an entry failed, the index is incomplete and no longer extended
+
+} indexed_t;
+
+static int indexed_write(void *self, int level, const char *data, size_t len) {
+  indexed_t *x = (indexed_t *)self;
+
+  pthread_mutex_lock(&x->lock);
+  // Once an entry failed the index is left alone: entries after a short write would be misaligned
+  if (!x->error &&
+      (!x->has_entry || (x->every_records && x->seq - x->last_seq >= x->every_records) ||
+       (x->every_bytes && x->offset - x->last_offset >= x->every_bytes))) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint8_t entry[24];
+    store_le64(entry, (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec);
+    store_le64(entry + 8, x->seq);
+    store_le64(entry + 16, x->offset);
+    // An entry may point past what `inner` has flushed yet, readers stop at the end of the file
+    struct iovec iov = {entry, sizeof(entry)};
+    if (writev_all(x->index_fd, &iov, 1) != 0)
+      x->error = 1;
+    x->last_offset = x->offset;
+    x->last_seq = x->seq;
+    x->has_entry = 1;
+  }
+
+  int result = x->inner->write_fn(x->inner->self, level, data, len);
+  if (result != -1) {
+    x->offset += len;
+    x->seq++;
+  }
+  if (x->error)
+    result = -1;
+  pthread_mutex_unlock(&x->lock);
+
+  return result;
+}
+
+static int indexed_flush(void *self) {
+  indexed_t *x = (indexed_t *)self;
+  int result = display_sink_flush(x->inner);
+
+  pthread_mutex_lock(&x->lock);
+  if (x->error)
+    result = -1;
+  pthread_mutex_unlock(&x->lock);
+  return result;
+}
+
+static int indexed_close(void *self) {
+  indexed_t *x = (indexed_t *)self;
+  int result = display_sink_close(x->inner);
+
+  if (close(x->index_fd) != 0 || x->error)
+    result = -1;
+  pthread_mutex_destroy(&x->lock);
+  free(x);
+  return result;
+}
+
+display_sink_t *display_indexed_open(display_sink_t *inner, const char *index_path,
+                                     uint64_t base_offset, unsigned every_records,
+                                     size_t every_bytes) {
+  if (!inner || !index_path)
+    return NULL;
+
+  indexed_t *x = (indexed_t *)calloc(1, sizeof(indexed_t));
+  if (!x)
+    return NULL;
+  x->index_fd = open(index_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+  int ok = x->index_fd >= 0 && fstat(x->index_fd, &st) == 0;
+  if (ok && st.st_size == 0) {
+    struct iovec iov = {(void *)DISPLAY_INDEX_MAGIC, 8};
+    ok = writev_all(x->index_fd, &iov, 1) == 0;
+  }
+  if (!ok || pthread_mutex_init(&x->lock, NULL) != 0) {
+    if (x->index_fd >= 0)
+      close(x->index_fd);
+    free(x);
+    return NULL;
+  }
+
+  x->sink = (display_sink_t){indexed_write, indexed_flush, indexed_close, x};
+  x->inner = inner;
+  x->every_records = every_records;
+  x->every_bytes = every_bytes;
+  x->offset = base_offset;
+  return &x->sink;
+}
+
+int display_index_seek(const char *index_path, int key, uint64_t value, display_index_entry_t *at,
+                       display_index_entry_t *after) {
+  if (!index_path || !at || (key != DISPLAY_INDEX_TIME && key != DISPLAY_INDEX_SEQ))
+    return -1;
+
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < 8) {
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  size_t size = (size_t)st.st_size;
+  const uint8_t *map = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == (const uint8_t *)MAP_FAILED)
+    return -1;
+  if (memcmp(map, DISPLAY_INDEX_MAGIC, 8) != 0) {
+    munmap((void *)map, size);
+    return -1;
+  }
+
+  // Entries are in write order, so both keys only grow (unless the clock is set back)
+  const uint8_t *entries = map + 8;
+  size_t count = (size - 8) / 24;
+  size_t lo = 0, hi = count; // The answer is the last of [0, lo)
+  size_t field = key == DISPLAY_INDEX_TIME ? 0 : 8;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (load_le64(entries + 24 * mid + field) <= value)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int result = 0;
+  if (lo > 0) {
+    const uint8_t *e = entries + 24 * (lo - 1);
+    *at = (display_index_entry_t){load_le64(e), load_le64(e + 8), load_le64(e + 16)};
+    result = 1;
+  }
+  if (after && lo < count) {
+    const uint8_t *e = entries + 24 * lo;
+    *after = (display_index_entry_t){load_le64(e), load_le64(e + 8), load_le64(e + 16)};
+  } else if (after) {
+    *after = (display_index_entry_t){UINT64_MAX, UINT64_MAX, UINT64_MAX};
+  }
+
+  munmap((void *)map, size);
+  return result;
+}
+
+int display_stdout_bypass(int fd, size_t capacity, const display_flush_policy_t *policy) {
+  if (stdout_sink)
+    return -1;
+
+  fflush(stdout); // Keep what stdio already buffered in front
+  display_sink_t *sink = display_fdbuf_open(fd, capacity, policy);
+  if (!sink)
+    return -1;
+
+  stdout_sink = sink;
+  return 0;
+}
+
+int display_stdout_restore(void) {
+  display_sink_t *sink = stdout_sink;
+  if (!sink)
+    return 0;
+
+  stdout_sink = NULL;
+  return display_sink_close(sink);
+}
+
+#endif // _WIN32
+
 #endif // DISPLAY_IMPLEMENTATION
 
 #ifdef DISPLAY_STRIP_PREFIX
@@ -990,6 +5376,12 @@ int display_snprintln(char *buf, size_t size, const char *__restrict format, ...
 #define snprintln display_snprintln
 #define vsnprint display_vsnprint
 #define vsnprintln display_vsnprintln
+#define sinkprint display_sinkprint
+#define sinkprintln display_sinkprintln
+#define vsinkprint display_vsinkprint
+#define vsinkprintln display_vsinkprintln
+#define sinklog display_sinklog
+#define vsinklog display_vsinklog
 #endif // DISPLAY_STRIP_PREFIX
 
 /*
@@ -0,0 +1,161 @@
+/* display_merge.c
+
+Merges the per-thread files of a display_shard_open sink into one stream ordered by their
+stamps, with a k-way merge: a binary heap of the next record of each memory-mapped shard.
+Records with equal stamps come out in the order of the files on the command line, and records
+of one shard always stay in their order.
+
+  display_merge [-s] [-o out] shard...
+    -s  prefix every record with its stamp and a tab
+    -o  write to out instead of stdout
+
+A shard cut short by a crash is merged up to its last whole record, with a warning.
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct cursor_t {
+  const char *path;
+  const uint8_t *map;
+  size_t size, pos; // pos: the stamp of the next record
+  uint64_t stamp;
+  int index; // On the command line, to break ties
+
+} cursor_t;
+
+static uint64_t read_le(const uint8_t *p, int bytes) {
+  uint64_t v = 0;
+  for (int i = bytes - 1; i >= 0; i--)
+    v = v << 8 | p[i];
+  return v;
+}
+
+/// @brief Loads the stamp of the record at c->pos
+/// @return 1 if there is a whole record, 0 at the end of the shard
+static int cursor_peek(cursor_t *c) {
+  if (c->size - c->pos < 12)
+    return 0;
+  uint64_t len = read_le(c->map + c->pos + 8, 4);
+  if (len > c->size - c->pos - 12) {
+    fprintf(stderr, "display_merge: %s: torn record at offset %zu, %zu bytes ignored\n", c->path,
+            c->pos, c->size - c->pos);
+    return 0;
+  }
+
+  c->stamp = read_le(c->map + c->pos, 8);
+  return 1;
+}
+
+static int cursor_before(const cursor_t *a, const cursor_t *b) {
+  return a->stamp < b->stamp || (a->stamp == b->stamp && a->index < b->index);
+}
+
+static void heap_down(cursor_t **heap, size_t n, size_t i) {
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < n && cursor_before(heap[l], heap[min]))
+      min = l;
+    if (r < n && cursor_before(heap[r], heap[min]))
+      min = r;
+    if (min == i)
+      return;
+
+    cursor_t *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+int main(int argc, char **argv) {
+  int stamps = 0;
+  const char *out_path = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "so:h")) != -1) {
+    switch (opt) {
+    case 's':
+      stamps = 1;
+      break;
+    case 'o':
+      out_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s] [-o out] shard...\n", argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, "Usage: %s [-s] [-o out] shard...\n", argv[0]);
+    return 2;
+  }
+
+  FILE *out = out_path ? fopen(out_path, "w") : stdout;
+  size_t count = (size_t)(argc - optind);
+  cursor_t *cursors = (cursor_t *)calloc(count, sizeof(cursor_t));
+  cursor_t **heap = (cursor_t **)calloc(count, sizeof(cursor_t *));
+  if (!out || !cursors || !heap) {
+    perror("display_merge");
+    return 1;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < count; i++) {
+    cursor_t *c = &cursors[i];
+    c->path = argv[optind + i];
+    c->index = (int)i;
+
+    int fd = open(c->path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+      perror(c->path);
+      return 1;
+    }
+    c->size = (size_t)st.st_size;
+    c->map = c->size ? (const uint8_t *)mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (c->map == (const uint8_t *)MAP_FAILED) {
+      perror(c->path);
+      return 1;
+    }
+    if (c->size < 8 || memcmp(c->map, DISPLAY_SHARD_MAGIC, 8) != 0) {
+      fprintf(stderr, "display_merge: %s is not a shard\n", c->path);
+      return 1;
+    }
+
+    madvise((void *)c->map, c->size, MADV_SEQUENTIAL);
+    c->pos = 8;
+    if (cursor_peek(c))
+      heap[n++] = c;
+  }
+
+  for (size_t i = n / 2; i-- > 0;)
+    heap_down(heap, n, i);
+
+  while (n > 0) {
+    cursor_t *c = heap[0];
+    size_t len = (size_t)read_le(c->map + c->pos + 8, 4);
+    if (stamps)
+      fprintf(out, "%llu\t", (unsigned long long)c->stamp);
+    fwrite(c->map + c->pos + 12, 1, len, out);
+    c->pos += 12 + len;
+
+    if (!cursor_peek(c))
+      heap[0] = heap[--n];
+    heap_down(heap, n, 0);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (cursors[i].map)
+      munmap((void *)cursors[i].map, cursors[i].size);
+  }
+  free(cursors);
+  free(heap);
+  return fclose(out) == 0 ? 0 : 1;
+}
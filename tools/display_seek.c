@@ -0,0 +1,120 @@
+/* display_seek.c
+
+Prints the records of a time or record-number range of a large log, using the sidecar index
+written by display_indexed_open to read only the part of the file that holds them.
+
+  display_seek [-t from] [-T to] [-s from] [-S to] [-f] [-i index] log
+    -t, -T  first and last time, in seconds since the epoch (fractions allowed)
+    -s, -S  first and last record number, instead of times
+    -f      the log is framed (display_framed_open): print only valid records
+    -i      the index, <log>.idx by default
+
+The output starts at the last index entry at or before `from` and ends at the first entry after
+`to`, so it holds the range plus at most one indexing interval on each side.
+
+*/
+#define DISPLAY_IMPLEMENTATION
+#include "../display.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static uint64_t parse_time_ns(const char *arg) { return (uint64_t)(strtod(arg, NULL) * 1e9); }
+
+int main(int argc, char **argv) {
+  const char *index_path = NULL;
+  int key = DISPLAY_INDEX_TIME, framed = 0, by_time = 0, by_seq = 0;
+  uint64_t from = 0, to = UINT64_MAX;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:T:s:S:fi:h")) != -1) {
+    switch (opt) {
+    case 't':
+      from = parse_time_ns(optarg);
+      by_time = 1;
+      break;
+    case 'T':
+      to = parse_time_ns(optarg);
+      by_time = 1;
+      break;
+    case 's':
+      from = strtoull(optarg, NULL, 10);
+      by_seq = 1;
+      break;
+    case 'S':
+      to = strtoull(optarg, NULL, 10);
+      by_seq = 1;
+      break;
+    case 'f':
+      framed = 1;
+      break;
+    case 'i':
+      index_path = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t from] [-T to] [-s from] [-S to] [-f] [-i index] log\n",
+              argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+  if (optind != argc - 1 || (by_time && by_seq)) {
+    fprintf(stderr, "Usage: %s [-t from] [-T to] [-s from] [-S to] [-f] [-i index] log\n",
+            argv[0]);
+    return 2;
+  }
+  if (by_seq)
+    key = DISPLAY_INDEX_SEQ;
+
+  const char *log_path = argv[optind];
+  char default_index[4096];
+  if (!index_path) {
+    snprintf(default_index, sizeof(default_index), "%s.idx", log_path);
+    index_path = default_index;
+  }
+
+  display_index_entry_t first, last, after;
+  int found = display_index_seek(index_path, key, from, &first, NULL);
+  if (found == -1 || display_index_seek(index_path, key, to, &last, &after) == -1) {
+    fprintf(stderr, "display_seek: cannot read index %s\n", index_path);
+    return 1;
+  }
+  uint64_t start = found ? first.offset : 0;
+
+  int fd = open(log_path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(log_path);
+    return 1;
+  }
+  uint64_t size = (uint64_t)st.st_size, end = after.offset < size ? after.offset : size;
+  if (start >= end) {
+    close(fd);
+    return 0;
+  }
+
+  // Map only the range: the rest of the file is never read
+  uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE), map_start = start / page * page;
+  size_t map_size = (size_t)(end - map_start);
+  char *map = (char *)mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, (off_t)map_start);
+  close(fd);
+  if (map == (char *)MAP_FAILED) {
+    perror(log_path);
+    return 1;
+  }
+
+  const char *buf = map + (start - map_start);
+  size_t len = (size_t)(end - start);
+  if (framed) {
+    size_t pos = 0, record_len;
+    const char *record;
+    while (display_frame_next(buf, len, &pos, &record, &record_len, NULL))
+      fwrite(record, 1, record_len, stdout);
+  } else {
+    fwrite(buf, 1, len, stdout);
+  }
+
+  munmap(map, map_size);
+  return 0;
+}